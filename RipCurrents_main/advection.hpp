@@ -0,0 +1,178 @@
+#ifndef __ADVECTION_HPP_INCLUDE__
+#define __ADVECTION_HPP_INCLUDE__
+
+#include <math.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "ripcurrents.hpp"
+#include "sampling.hpp"
+
+// The one particle integrator behind streamline, streamline_field, get_delta and the particles.
+// What differs between them is picked at compile time, so each use gets its own
+// inlined loop with no runtime branches:
+//   Sink - told about every step a point takes (NoSink, DistanceSink, DrawSink)
+//   RowOffset - false: pts are positions; true: pts[k] is a displacement from pixel (xoffset + k, yoffset)
+//   Method - INTEGRATE_EULER, INTEGRATE_MIDPOINT or INTEGRATE_RK4
+//   StopAboveUpper - a point stops for this call once its flow is faster than UPPER
+// The number of sub-steps is a runtime argument, each one covers dt / substeps.
+
+// Does nothing with the steps.
+struct NoSink {
+	inline void step(int, const Pixel2&, const Pixel2&, float) {}
+};
+
+// Adds the flow magnitude of every step to distance[k].
+struct DistanceSink {
+	explicit DistanceSink(float* distance) : distance(distance) {}
+	inline void step(int k, const Pixel2&, const Pixel2&, float r) { distance[k] += r; }
+	float* distance;
+};
+
+// Draws every step on the overlay.
+struct DrawSink {
+	DrawSink(cv::Mat overlay, cv::Scalar color) : overlay(overlay), color(color) {}
+	inline void step(int, const Pixel2& from, const Pixel2& to, float) { cv::line(overlay, from, to, color, 1, 8, 0); }
+	cv::Mat overlay;
+	cv::Scalar color;
+};
+
+// The flow at time t of the frame, by linear interpolation from the previous field (t = 0)
+// to the current one (t = 1). Without a previous field the current one holds for the whole frame.
+// valid - output: 0 where either field can not be sampled
+inline void sample_flow_at(const cv::Mat& flow, const cv::Mat& previous, float t, const float* xs, const float* ys, int n,
+	float* dx, float* dy, unsigned char* valid){
+	sample_flow(flow, xs, ys, n, dx, dy, valid);
+	if ( previous.empty() || t >= 1 ) return;
+
+	float px[SAMPLE_BLOCK], py[SAMPLE_BLOCK];
+	unsigned char pvalid[SAMPLE_BLOCK];
+	sample_flow(previous, xs, ys, n, px, py, pvalid);
+	for ( int k = 0; k < n; k++ ) {
+		dx[k] = px[k] + (dx[k] - px[k]) * t;
+		dy[k] = py[k] + (dy[k] - py[k]) * t;
+		valid[k] &= pvalid[k];
+	}
+}
+
+// One step of Method for up to SAMPLE_BLOCK points.
+// xs, ys - start positions
+// t0, h - the step starts at time t0 of the frame and is h long, in frames
+// dt - displacement per frame of flow, the step moves by flow * dt * h
+// ox, oy - output: how far each point moves
+// r - output: flow magnitude at the start, what UPPER and the distance sink look at
+// valid - output: 0 where any stage left the flow
+template <int Method>
+void integrate_step(const cv::Mat& flow, const cv::Mat& previous, float t0, float h, float dt,
+	const float* xs, const float* ys, int n, float* ox, float* oy, float* r, unsigned char* valid){
+	float k1x[SAMPLE_BLOCK], k1y[SAMPLE_BLOCK];
+	sample_flow_at(flow, previous, t0, xs, ys, n, k1x, k1y, valid);
+	for ( int k = 0; k < n; k++ ) r[k] = sqrtf(k1x[k]*k1x[k] + k1y[k]*k1y[k]);
+	float step = dt * h;
+
+	if ( Method == INTEGRATE_EULER ) {
+		for ( int k = 0; k < n; k++ ) {
+			ox[k] = k1x[k] * step;
+			oy[k] = k1y[k] * step;
+		}
+		return;
+	}
+
+	float mx[SAMPLE_BLOCK], my[SAMPLE_BLOCK];
+	float k2x[SAMPLE_BLOCK], k2y[SAMPLE_BLOCK];
+	unsigned char stage_valid[SAMPLE_BLOCK];
+	for ( int k = 0; k < n; k++ ) {
+		mx[k] = xs[k] + k1x[k] * step * .5f;
+		my[k] = ys[k] + k1y[k] * step * .5f;
+	}
+	sample_flow_at(flow, previous, t0 + h * .5f, mx, my, n, k2x, k2y, stage_valid);
+	for ( int k = 0; k < n; k++ ) valid[k] &= stage_valid[k];
+
+	if ( Method == INTEGRATE_MIDPOINT ) {
+		for ( int k = 0; k < n; k++ ) {
+			ox[k] = k2x[k] * step;
+			oy[k] = k2y[k] * step;
+		}
+		return;
+	}
+
+	// RK4, k3 at the midpoint again and k4 at the end
+	float k3x[SAMPLE_BLOCK], k3y[SAMPLE_BLOCK];
+	for ( int k = 0; k < n; k++ ) {
+		mx[k] = xs[k] + k2x[k] * step * .5f;
+		my[k] = ys[k] + k2y[k] * step * .5f;
+	}
+	sample_flow_at(flow, previous, t0 + h * .5f, mx, my, n, k3x, k3y, stage_valid);
+	for ( int k = 0; k < n; k++ ) {
+		valid[k] &= stage_valid[k];
+		mx[k] = xs[k] + k3x[k] * step;
+		my[k] = ys[k] + k3y[k] * step;
+	}
+	float k4x[SAMPLE_BLOCK], k4y[SAMPLE_BLOCK];
+	sample_flow_at(flow, previous, t0 + h, mx, my, n, k4x, k4y, stage_valid);
+	for ( int k = 0; k < n; k++ ) {
+		valid[k] &= stage_valid[k];
+		ox[k] = (k1x[k] + 2 * (k2x[k] + k3x[k]) + k4x[k]) * step / 6;
+		oy[k] = (k1y[k] + 2 * (k2y[k] + k3y[k]) + k4y[k]) * step / 6;
+	}
+}
+
+// pts - points, advanced in place
+// n - number of points
+// xoffset, yoffset - where pts[0] sits when RowOffset is set
+// flow - CV_32FC2
+// previous - flow of the frame before, for time interpolation, or empty
+// dt - time step of a whole call
+// substeps - steps per call
+// UPPER - speed limit when StopAboveUpper is set
+// sink - see above
+// A point also stops once it leaves the flow.
+template <typename Sink, bool RowOffset, int Method, bool StopAboveUpper>
+void advect(Pixel2* pts, int n, int xoffset, int yoffset, const cv::Mat& flow, const cv::Mat& previous,
+	float dt, int substeps, float UPPER, Sink& sink){
+	float xs[SAMPLE_BLOCK], ys[SAMPLE_BLOCK], ox[SAMPLE_BLOCK], oy[SAMPLE_BLOCK], r[SAMPLE_BLOCK];
+	unsigned char valid[SAMPLE_BLOCK];
+	int index[SAMPLE_BLOCK];
+	if ( substeps < 1 ) substeps = 1;
+	const float h = 1.0f / substeps;
+
+	for ( int start = 0; start < n; start += SAMPLE_BLOCK ) {
+		int active = n - start < SAMPLE_BLOCK ? n - start : SAMPLE_BLOCK;
+		for ( int k = 0; k < active; k++ ) index[k] = start + k;
+
+		for ( int i = 0; i < substeps && active > 0; i++ ) {
+			for ( int k = 0; k < active; k++ ) {
+				xs[k] = pts[index[k]].x + (RowOffset ? xoffset + index[k] : 0);
+				ys[k] = pts[index[k]].y + (RowOffset ? yoffset : 0);
+			}
+			integrate_step<Method>(flow, previous, i * h, h, dt, xs, ys, active, ox, oy, r, valid);
+
+			// keep only the points that are still moving
+			int kept = 0;
+			for ( int k = 0; k < active; k++ ) {
+				if ( !valid[k] ) continue;
+				if ( StopAboveUpper && r[k] > UPPER ) continue;
+				Pixel2& pt = pts[index[k]];
+				Pixel2 newpt(pt.x + ox[k], pt.y + oy[k]);
+				sink.step(index[k], pt, newpt, r[k]);
+				pt = newpt;
+				index[kept++] = index[k];
+			}
+			active = kept;
+		}
+	}
+}
+
+// Picks the advect() instantiation for a runtime INTEGRATE_ method.
+template <typename Sink, bool RowOffset, bool StopAboveUpper>
+void advect_with(int method, Pixel2* pts, int n, int xoffset, int yoffset, const cv::Mat& flow, const cv::Mat& previous,
+	float dt, int substeps, float UPPER, Sink& sink){
+	if ( method == INTEGRATE_RK4 )
+		advect<Sink, RowOffset, INTEGRATE_RK4, StopAboveUpper>(pts, n, xoffset, yoffset, flow, previous, dt, substeps, UPPER, sink);
+	else if ( method == INTEGRATE_MIDPOINT )
+		advect<Sink, RowOffset, INTEGRATE_MIDPOINT, StopAboveUpper>(pts, n, xoffset, yoffset, flow, previous, dt, substeps, UPPER, sink);
+	else
+		advect<Sink, RowOffset, INTEGRATE_EULER, StopAboveUpper>(pts, n, xoffset, yoffset, flow, previous, dt, substeps, UPPER, sink);
+}
+
+#endif
@@ -0,0 +1,571 @@
+#include <math.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+
+#include "flow_engine.hpp"
+#include "ripcurrents.hpp"
+#include "sampling.hpp"
+#include "particles.hpp"
+
+// Microbenchmark for the per-pixel kernels of ripcurrents_module.cpp.
+// Runs every kernel on synthetic flow fields over a grid of resolutions, thread counts and flow
+// patterns, and prints one CSV line (or JSON object) per combination. No video or highgui needed.
+// With --engines it times the optical flow backends instead, together with how far off their flow is.
+
+#define BENCH_STREAMLINES 100 // Same as the seeded discrete streamlines in pipeline.cpp
+#define BENCH_PARTICLES 200000 // Dense particle visualisation
+#define BENCH_RING 8 // averageVector ring length, the real BUFFER_FRAME ring does not change the per-call cost
+#define BENCH_CLIP_PAIRS 10 // consecutive frame pairs taken from --clip, or synthesized for --engines
+#define BENCH_EPE_MARGIN 8 // border left out of the flow error, no engine has the data to get it right
+
+struct BenchResult {
+	std::string kernel;
+	std::string flow;
+	int width, height;
+	int threads;
+	int reps;
+	double median;	// seconds per call
+	double min;
+	double epe;	// mean endpoint error in pixels, for the flow engines; -1 otherwise
+};
+
+// flow - output, CV_32FC2
+// pattern - still, uniform, rip, vortex or noise
+// magnitude - typical speed in pixels per frame
+// returns false for an unknown pattern
+bool make_flow(Mat& flow, Size size, const std::string& pattern, float magnitude){
+	flow = Mat::zeros(size, CV_32FC2);
+	float cx = size.width / 2.0;
+	float cy = size.height / 2.0;
+
+	if ( pattern == "still" ) return true;
+	if ( pattern == "noise" ) {
+		randn(flow, Scalar(0, 0), Scalar(magnitude, magnitude));
+		return true;
+	}
+	if ( pattern != "uniform" && pattern != "rip" && pattern != "vortex" ) return false;
+
+	flow.forEach<Pixel2>([&](Pixel2& pixel, const int position[]) -> void {
+		float x = position[1] - cx;
+		float y = position[0] - cy;
+		if ( pattern == "uniform" ) {
+			pixel = Pixel2(magnitude, 0.3 * magnitude);
+		} else if ( pattern == "rip" ) {
+			// waves push shoreward (down), a narrow jet in the middle runs back out to sea
+			float jet = exp(-(x * x) / (2 * (size.width / 16.0) * (size.width / 16.0)));
+			pixel = Pixel2(-0.2 * magnitude * x / cx, magnitude * (1 - 2.5 * jet));
+		} else {
+			float r = sqrt(x * x + y * y) + 1;
+			pixel = Pixel2(-y / r * magnitude, x / r * magnitude);
+		}
+	});
+	return true;
+}
+
+// reps - timed calls
+// setup - untimed, run before every call
+// run - the timed call
+BenchResult time_kernel(int reps, std::function<void()> setup, std::function<void()> run){
+	std::vector<double> times;
+	setup();
+	run(); // warm up caches and the thread pool
+	for ( int i = 0; i < reps; i++ ) {
+		setup();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		run();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		times.push_back(elapsed.count());
+	}
+	std::sort(times.begin(), times.end());
+
+	BenchResult result;
+	result.reps = reps;
+	result.median = times[times.size() / 2];
+	result.min = times[0];
+	result.epe = -1;
+	return result;
+}
+
+void print_result(const BenchResult& r, bool json, bool& first){
+	double mpix = r.width * (double)r.height / 1000000.0;
+	char epe[32] = "";
+	if ( r.epe >= 0 ) snprintf(epe, sizeof(epe), "%.4f", r.epe);
+	if ( json ) {
+		printf("%s  {\"kernel\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, \"flow\": \"%s\", \"reps\": %d, "
+			"\"median_ms\": %.4f, \"min_ms\": %.4f, \"mpix_per_s\": %.2f, \"epe\": %s}",
+			first ? "" : ",\n", r.kernel.c_str(), r.width, r.height, r.threads, r.flow.c_str(), r.reps,
+			r.median * 1000, r.min * 1000, mpix / r.median, r.epe >= 0 ? epe : "null");
+	} else {
+		if ( first ) printf("kernel,width,height,threads,flow,reps,median_ms,min_ms,mpix_per_s,epe\n");
+		printf("%s,%d,%d,%d,%s,%d,%.4f,%.4f,%.2f,%s\n", r.kernel.c_str(), r.width, r.height, r.threads, r.flow.c_str(),
+			r.reps, r.median * 1000, r.min * 1000, mpix / r.median, epe);
+	}
+	first = false;
+	fflush(stdout);
+}
+
+// Runs every kernel once for one resolution, thread count and flow pattern.
+void bench_kernels(Size size, int threads, const std::string& pattern, float magnitude, int reps, bool json, bool& first){
+	Mat flow;
+	make_flow(flow, size, pattern, magnitude);
+
+	// polar form as analyze_frame() builds it
+	Mat splitarr[2];
+	split(flow,splitarr);
+	Mat combine[3];
+	cartToPolar(splitarr[0], splitarr[1], combine[2], combine[0],true);
+	combine[1] = combine[2];
+	Mat polar;
+	merge(combine,3,polar);
+
+	// thresholds from the field itself, like after a few frames of the real loop
+	int hist[HIST_BINS] = {0};
+	int histsum = 0;
+	int hist2d[HIST_DIRECTIONS][HIST_BINS] = {{0}};
+	int histsum2d[HIST_DIRECTIONS] = {0};
+	float UPPER = 100.0;
+	float UPPER2d[HIST_DIRECTIONS] = {0};
+	float prop_above_upper[HIST_DIRECTIONS] = {0};
+	create_histogram(polar, hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+	if ( UPPER <= 0 ) UPPER = 100.0; // still water has no fast bin
+
+	std::vector<BenchResult> results;
+
+	// the bilinear sampler alone, at every pixel plus a sub-pixel offset, vector against scalar
+	std::vector<float> xs(size.area()), ys(size.area()), dx(size.area()), dy(size.area());
+	std::vector<unsigned char> valid(size.area());
+	for ( int i = 0; i < size.area(); i++ ) {
+		xs[i] = i % size.width + .25f;
+		ys[i] = i / size.width + .75f;
+	}
+	results.push_back(time_kernel(reps, []{}, [&]{
+		sample_flow(flow, &xs[0], &ys[0], size.area(), &dx[0], &dy[0], &valid[0]);
+	}));
+	results.back().kernel = "sample_flow";
+	results.push_back(time_kernel(reps, []{}, [&]{
+		sample_flow_scalar(flow, &xs[0], &ys[0], size.area(), &dx[0], &dy[0], &valid[0]);
+	}));
+	results.back().kernel = "sample_flow_scalar";
+
+	// integrators: the Euler default, the higher orders, Euler sub-stepped to comparable cost,
+	// and RK4 blending in time from a previous field (the same one here, only the cost matters)
+	const int bench_integrators = 5;
+	const char* integrator_names[bench_integrators] = {"", "_midpoint", "_rk4", "_euler4", "_rk4_interpolated"};
+	Integrator integrators[bench_integrators];
+	integrators[1].method = INTEGRATE_MIDPOINT;
+	integrators[2].method = INTEGRATE_RK4;
+	integrators[3].substeps = 4;
+	integrators[4].method = INTEGRATE_RK4;
+	integrators[4].previous = flow;
+
+	Mat streamlines_mat, streamlines_distance;
+	for ( int i = 0; i < bench_integrators; i++ ) {
+		results.push_back(time_kernel(reps, [&]{
+			streamlines_mat = Mat::zeros(size, CV_32FC2);
+			streamlines_distance = Mat::zeros(size, CV_32FC1);
+		}, [&]{
+			streamline_field_rows(streamlines_mat, streamlines_distance, flow, 2, UPPER, integrators[i], Mat());
+		}));
+		results.back().kernel = std::string("streamline_field") + integrator_names[i];
+	}
+
+	// a water mask over the lower half, the cost should halve
+	Mat half_water = Mat::zeros(size, CV_8UC1);
+	half_water(Rect(0, size.height / 2, size.width, size.height - size.height / 2)).setTo(Scalar(255));
+	results.push_back(time_kernel(reps, [&]{
+		streamlines_mat = Mat::zeros(size, CV_32FC2);
+		streamlines_distance = Mat::zeros(size, CV_32FC1);
+	}, [&]{
+		streamline_field_rows(streamlines_mat, streamlines_distance, flow, 2, UPPER, integrators[0], half_water);
+	}));
+	results.back().kernel = "streamline_field_water50";
+
+	Mat delta;
+	results.push_back(time_kernel(reps, [&]{
+		delta = Mat::zeros(size, CV_32FC2);
+	}, [&]{
+		get_delta_rows(delta, flow, 2, UPPER, Mat());
+	}));
+	results.back().kernel = "get_delta";
+
+	Mat streamoverlay = Mat::zeros(size, CV_8UC1);
+	Pixel2 streampt[BENCH_STREAMLINES];
+	results.push_back(time_kernel(reps, [&]{
+		for(int x = 0; x < 10; x++){
+			for(int y = 0; y < 10; y++){
+				streampt[x * 10 + y] = Pixel2(size.width * x / 10, size.height * y / 10);
+			}
+		}
+	}, [&]{
+		streamline(streampt, BENCH_STREAMLINES, Scalar(128), flow, streamoverlay, 2, UPPER, integrators[0]);
+	}));
+	results.back().kernel = "streamline";
+
+	// the particle engine at the dense end, respawning so the count stays up
+	Particles particles;
+	for ( int i = 0; i < bench_integrators; i++ ) {
+		results.push_back(time_kernel(reps, [&]{
+			init_particles(particles, size, BENCH_PARTICLES, SEED_RANDOM, RESPAWN_DEAD, 0, Mat());
+		}, [&]{
+			advance_particles(particles, flow, 2, UPPER, integrators[i]);
+		}));
+		results.back().kernel = std::string("advance_particles") + integrator_names[i];
+	}
+
+	results.push_back(time_kernel(reps, []{}, [&]{
+		create_histogram(polar, hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+	}));
+	results.back().kernel = "create_histogram";
+
+	Mat polar_copy, waterclass, accumulator2;
+	results.push_back(time_kernel(reps, [&]{
+		polar.copyTo(polar_copy);
+		waterclass = Mat::zeros(size, CV_32FC3);
+		accumulator2 = Mat::zeros(size, CV_32FC3);
+	}, [&]{
+		create_flow(polar_copy, waterclass, accumulator2, UPPER, .5, .2, UPPER2d);
+	}));
+	results.back().kernel = "create_flow";
+
+	// the same work fused, from the raw flow, against polar conversion + create_histogram + create_flow
+	Mat display;
+	results.push_back(time_kernel(reps, [&]{
+		waterclass = Mat::zeros(size, CV_32FC3);
+		accumulator2 = Mat::zeros(size, CV_32FC3);
+		display.create(size, CV_32FC3);
+	}, [&]{
+		create_histogram_flow(flow, hist, histsum, hist2d, histsum2d, UPPER, .5, .2, UPPER2d, waterclass, accumulator2, display, Mat());
+	}));
+	results.back().kernel = "create_histogram_flow";
+	results.push_back(time_kernel(reps, [&]{
+		waterclass = Mat::zeros(size, CV_32FC3);
+		accumulator2 = Mat::zeros(size, CV_32FC3);
+		display.create(size, CV_32FC3);
+	}, [&]{
+		create_histogram_flow(flow, hist, histsum, hist2d, histsum2d, UPPER, .5, .2, UPPER2d, waterclass, accumulator2, display, half_water);
+	}));
+	results.back().kernel = "create_histogram_flow_water50";
+	results.push_back(time_kernel(reps, [&]{
+		waterclass = Mat::zeros(size, CV_32FC3);
+		accumulator2 = Mat::zeros(size, CV_32FC3);
+	}, [&]{
+		Mat splitarr[2];
+		split(flow,splitarr);
+		Mat combine[3];
+		cartToPolar(splitarr[0], splitarr[1], combine[2], combine[0],true);
+		combine[1] = combine[2];
+		Mat unfused;
+		merge(combine,3,unfused);
+		create_histogram(unfused, hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+		create_flow(unfused, waterclass, accumulator2, UPPER, .5, .2, UPPER2d);
+	}));
+	results.back().kernel = "polar_histogram_flow_unfused";
+
+	Mat accumulator = Mat::zeros(size, CV_32FC3);
+	Mat out, outmask;
+	results.push_back(time_kernel(reps, [&]{
+		out = Mat::zeros(size, CV_32FC3);
+		outmask = Mat::zeros(size, CV_8UC1);
+	}, [&]{
+		create_accumulationbuffer(accumulator, accumulator2, out, outmask, 100);
+	}));
+	results.back().kernel = "create_accumulationbuffer";
+
+	const char* history_names[3] = {"averageVector", "averageVector_half", "averageVector_int16"};
+	for ( int history_format = HISTORY_FLOAT; history_format <= HISTORY_INT16; history_format++ ) {
+		std::vector<Mat> buffer;
+		for ( int i = 0; i < BENCH_RING; i++ ) buffer.push_back(Mat::zeros(size, history_type(history_format)));
+		Mat average = Mat::zeros(size, CV_32FC2);
+		int update_ith_buffer = 0;
+		results.push_back(time_kernel(reps, [&]{
+			update_ith_buffer = (update_ith_buffer + 1) % BENCH_RING;
+		}, [&]{
+			averageVector(buffer, history_format, flow, update_ith_buffer, average, UPPER, Mat(), BoxWeights());
+		}));
+		results.back().kernel = history_names[history_format];
+	}
+
+	Mat average = Mat::zeros(size, CV_32FC2);
+	results.push_back(time_kernel(reps, []{}, [&]{
+		averageVectorEMA(flow, average, 1.0 / (BUFFER_FRAME / 2), UPPER, Mat());
+	}));
+	results.back().kernel = "averageVectorEMA";
+
+	for ( size_t i = 0; i < results.size(); i++ ) {
+		results[i].flow = pattern;
+		results[i].width = size.width;
+		results[i].height = size.height;
+		results[i].threads = threads;
+		print_result(results[i], json, first);
+	}
+}
+
+// Mean endpoint error between two CV_32FC2 fields, without the BENCH_EPE_MARGIN border.
+double endpoint_error(const Mat& flow, const Mat& truth){
+	Rect inner(0, 0, flow.cols, flow.rows);
+	if ( flow.cols > 4 * BENCH_EPE_MARGIN && flow.rows > 4 * BENCH_EPE_MARGIN )
+		inner = Rect(BENCH_EPE_MARGIN, BENCH_EPE_MARGIN, flow.cols - 2 * BENCH_EPE_MARGIN, flow.rows - 2 * BENCH_EPE_MARGIN);
+	Mat diff = flow(inner) - truth(inner);
+	Mat splitarr[2];
+	split(diff, splitarr);
+	Mat error;
+	magnitude(splitarr[0], splitarr[1], error);
+	return mean(error)[0];
+}
+
+// Frames with a known, steady flow: blurred noise, moved along the field a frame at a time.
+// frames - output: count CV_8UC1 frames
+// truths - output: the flow between every frame and the next, exact for fields that are smooth on the scale of a pixel
+bool make_sequence(std::vector<Mat>& frames, std::vector<Mat>& truths, Size size, const std::string& pattern,
+	float magnitude, int count){
+	Mat truth, texture(size, CV_8UC1);
+	if ( !make_flow(truth, size, pattern, magnitude) ) return false;
+	randu(texture, Scalar(0), Scalar(256));
+	GaussianBlur(texture, texture, Size(5, 5), 1.5);
+
+	// frame k (p) = frame 0 (p - k flow(p))
+	frames.assign(count, Mat());
+	truths.assign(std::max(count - 1, 0), truth);
+	Mat mapx(size, CV_32FC1), mapy(size, CV_32FC1);
+	for ( int k = 0; k < count; k++ ) {
+		for ( int y = 0; y < size.height; y++ ) {
+			const Pixel2* f = truth.ptr<Pixel2>(y);
+			float* mx = mapx.ptr<float>(y);
+			float* my = mapy.ptr<float>(y);
+			for ( int x = 0; x < size.width; x++ ) {
+				mx[x] = x - k * f[x].x;
+				my[x] = y - k * f[x].y;
+			}
+		}
+		remap(texture, frames[k], mapx, mapy, INTER_LINEAR, BORDER_REPLICATE);
+	}
+	return true;
+}
+
+// Times every engine on the same consecutive frame pairs and measures its flow error.
+// prevs, nexts - at least two consecutive frame pairs at the bench size
+// truths - flow of every pair, from make_sequence() or from the reference engine on a clip
+// warm - also time every engine warm started the way --warm-start runs it, as flow_<engine>_warm
+// The first pair only starts the warm sequence, both variants are measured on the rest.
+void bench_engines(Size size, int threads, const std::string& source, const std::vector<FlowParams>& engines,
+	const std::vector<Mat>& prevs, const std::vector<Mat>& nexts, const std::vector<Mat>& truths,
+	bool warm, int reps, bool json, bool& first){
+	for ( size_t e = 0; e < engines.size(); e++ ) {
+		Ptr<DenseOpticalFlow> cold = create_flow_engine(engines[e], false, Ptr<DenseOpticalFlow>());
+		for ( int variant = 0; variant < (warm ? 2 : 1); variant++ ) {
+			// sharing the cold engine's frame cache, as in the program
+			Ptr<DenseOpticalFlow> engine = variant ? create_flow_engine(engines[e], true, cold) : cold;
+			Mat flow;
+			size_t pair = prevs.size() - 1;
+			// a cold engine gets no flow to start from, a warm one the last pair's, and a cold start when the sequence wraps
+			BenchResult result = time_kernel(reps, [&]{
+				if ( !variant ) flow.release();
+				if ( ++pair < prevs.size() ) return;
+				flow.release();
+				cold->calc(prevs[0], nexts[0], flow);
+				pair = 1;
+			}, [&]{
+				engine->calc(prevs[pair], nexts[pair], flow);
+			});
+
+			double epe = 0;
+			flow.release();
+			cold->calc(prevs[0], nexts[0], flow);
+			for ( size_t i = 1; i < prevs.size(); i++ ) {
+				if ( !variant ) flow.release();
+				engine->calc(prevs[i], nexts[i], flow);
+				epe += endpoint_error(flow, truths[i]);
+			}
+
+			result.kernel = std::string("flow_") + flow_engine_name(engines[e].engine) + (variant ? "_warm" : "");
+			result.flow = source;
+			result.width = size.width;
+			result.height = size.height;
+			result.threads = threads;
+			result.epe = epe / (prevs.size() - 1);
+			print_result(result, json, first);
+		}
+	}
+}
+
+// The Farneback settings the engines are measured against on real video, far slower and
+// more accurate than anything the program runs with.
+FlowParams reference_engine(){
+	FlowParams params;
+	params.engine = FLOW_FARNEBACK;
+	params.levels = 5;
+	params.winsize = 21;
+	params.iterations = 10;
+	params.poly_n = 7;
+	params.poly_sigma = 1.5;
+	return params;
+}
+
+// Splits a comma separated list.
+std::vector<std::string> split_list(const char* list){
+	std::vector<std::string> items;
+	std::string names(list);
+	size_t start = 0;
+	while ( start <= names.size() ) {
+		size_t end = names.find(',', start);
+		if ( end == std::string::npos ) end = names.size();
+		if ( end > start ) items.push_back(names.substr(start, end - start));
+		start = end + 1;
+	}
+	return items;
+}
+
+void usage(){
+	printf("Usage: ripcurrents_bench [options]\n");
+	printf("  --sizes <list>       resolutions, default 320x240,640x480,1280x960\n");
+	printf("  --threads <list>     OpenCV thread counts, default 1 and all cores\n");
+	printf("  --flows <list>       synthetic fields: still,uniform,rip,vortex,noise (default all)\n");
+	printf("  --magnitude <px>     typical speed of the fields in pixels per frame, default 1\n");
+	printf("  --reps <n>           timed calls per kernel, default 20\n");
+	printf("  --json               JSON instead of CSV\n");
+	printf("  --engines <list>     time these optical flow backends instead of the kernels, with their mean endpoint\n");
+	printf("                       error against the synthetic --flows: farneback,farneback-cached,\n");
+	printf("                       dis-ultrafast,dis-fast,dis-medium\n");
+	printf("  --flow-params <k=v>  backend parameters for --engines, as for ripcurrents\n");
+	printf("  --clip <video>       with --engines, use the first %d frame pairs of a video instead, the error is\n", BENCH_CLIP_PAIRS);
+	printf("                       then measured against a slow, accurate Farneback\n");
+	printf("  --warm               with --engines, also time them warm started from the last field, as --warm-start\n");
+}
+
+int main(int argc, char** argv)
+{
+	static struct option long_options[] = {
+		{"sizes", required_argument, 0, 's'},
+		{"threads", required_argument, 0, 't'},
+		{"flows", required_argument, 0, 'f'},
+		{"magnitude", required_argument, 0, 'm'},
+		{"reps", required_argument, 0, 'r'},
+		{"json", no_argument, 0, 'J'},
+		{"engines", required_argument, 0, 'e'},
+		{"flow-params", required_argument, 0, 'P'},
+		{"clip", required_argument, 0, 'c'},
+		{"warm", no_argument, 0, 'w'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	std::vector<std::string> sizes = split_list("320x240,640x480,1280x960");
+	std::vector<int> threads;
+	threads.push_back(1);
+	if ( getNumberOfCPUs() > 1 ) threads.push_back(getNumberOfCPUs());
+	std::vector<std::string> flows = split_list("still,uniform,rip,vortex,noise");
+	float magnitude = 1.0;
+	int reps = 20;
+	bool json = false;
+	std::vector<std::string> engine_names;
+	std::string flow_params;
+	std::string clip_name;
+	bool warm = false;
+
+	int opt;
+	while ( (opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1 ) {
+		switch ( opt ) {
+			case 's': sizes = split_list(optarg); break;
+			case 't': {
+				std::vector<std::string> list = split_list(optarg);
+				threads.clear();
+				for ( size_t i = 0; i < list.size(); i++ ) threads.push_back(atoi(list[i].c_str()));
+				break;
+			}
+			case 'f': flows = split_list(optarg); break;
+			case 'm': magnitude = atof(optarg); break;
+			case 'r': reps = std::max(1, atoi(optarg)); break;
+			case 'J': json = true; break;
+			case 'e': engine_names = split_list(optarg); break;
+			case 'P': flow_params = optarg; break;
+			case 'c': clip_name = optarg; break;
+			case 'w': warm = true; break;
+			case 'h': usage(); exit(0);
+			default: usage(); exit(-1);
+		}
+	}
+
+	for ( size_t f = 0; f < flows.size(); f++ ) {
+		Mat probe;
+		if ( !make_flow(probe, Size(4, 4), flows[f], magnitude) ) {
+			printf("Unknown flow %s\n", flows[f].c_str());
+			exit(-1);
+		}
+	}
+
+	std::vector<FlowParams> engines;
+	for ( size_t e = 0; e < engine_names.size(); e++ ) {
+		FlowParams params;
+		if ( !parse_flow_params(flow_params.c_str(), params) ) {
+			printf("Bad flow parameters %s\n", flow_params.c_str());
+			exit(-1);
+		}
+		if ( !parse_flow_engine(engine_names[e].c_str(), params) || params.engine == FLOW_SPARSE_LK ) {
+			printf("Unknown dense flow engine %s\n", engine_names[e].c_str());
+			exit(-1);
+		}
+		engines.push_back(params);
+	}
+
+	std::vector<Mat> clip;
+	if ( !clip_name.empty() ) {
+		VideoCapture video(clip_name);
+		Mat frame;
+		while ( (int)clip.size() <= BENCH_CLIP_PAIRS && video.read(frame) ) clip.push_back(frame.clone());
+		if ( clip.size() < 3 ) {
+			printf("Could not read three frames from %s\n", clip_name.c_str());
+			exit(-1);
+		}
+	}
+
+	bool first = true;
+	if ( json ) printf("[\n");
+	for ( size_t s = 0; s < sizes.size(); s++ ) {
+		int width, height;
+		if ( sscanf(sizes[s].c_str(), "%dx%d", &width, &height) != 2 || width < 4 || height < 4 ) {
+			printf("Bad size %s\n", sizes[s].c_str());
+			exit(-1);
+		}
+		for ( size_t t = 0; t < threads.size(); t++ ) {
+			setNumThreads(threads[t]);
+			Size size(width, height);
+			if ( engines.empty() ) {
+				for ( size_t f = 0; f < flows.size(); f++ ) {
+					bench_kernels(size, threads[t], flows[f], magnitude, reps, json, first);
+				}
+			} else if ( !clip.empty() ) {
+				std::vector<Mat> grays(clip.size()), truths;
+				for ( size_t i = 0; i < clip.size(); i++ ) {
+					Mat subframe;
+					resize(clip[i], subframe, size, 0, 0, INTER_LINEAR);
+					cvtColor(subframe, grays[i], COLOR_BGR2GRAY);
+				}
+				std::vector<Mat> prevs(grays.begin(), grays.end() - 1), nexts(grays.begin() + 1, grays.end());
+				Ptr<DenseOpticalFlow> reference = create_flow_engine(reference_engine(), false, Ptr<DenseOpticalFlow>());
+				for ( size_t i = 0; i < prevs.size(); i++ ) {
+					Mat truth;
+					reference->calc(prevs[i], nexts[i], truth);
+					truths.push_back(truth);
+				}
+				bench_engines(size, threads[t], "clip", engines, prevs, nexts, truths, warm, reps, json, first);
+			} else {
+				for ( size_t f = 0; f < flows.size(); f++ ) {
+					std::vector<Mat> frames, truths;
+					make_sequence(frames, truths, size, flows[f], magnitude, BENCH_CLIP_PAIRS + 1);
+					std::vector<Mat> prevs(frames.begin(), frames.end() - 1), nexts(frames.begin() + 1, frames.end());
+					bench_engines(size, threads[t], flows[f], engines, prevs, nexts, truths, warm, reps, json, first);
+				}
+			}
+		}
+	}
+	if ( json ) printf("\n]\n");
+
+	return 0;
+}
@@ -0,0 +1,442 @@
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "farneback.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FARNEBACK_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FARNEBACK_AVX2 1
+#endif
+
+using namespace cv;
+
+// Every filter here is symmetric or antisymmetric about its center, and both passes of a
+// separable filter are the same sum over taps: rows for the vertical pass, offsets into a
+// padded row for the horizontal one.
+//   out[i] = kernel[0] taps[0][i] + sum over j of kernel[j] (taps[j][i] + taps[-j][i])
+// or, odd:  sum over j of kernel[j] (taps[j][i] - taps[-j][i])
+// taps - indexed from -m to m
+// kernel - weights from the center out, m+1 of them
+
+static void symmetric_sum_scalar(const float* const* taps, const float* kernel, int m, bool odd, int start, int n, float* out){
+	for ( int i = start; i < n; i++ ) {
+		float s = 0;
+		if ( odd ) {
+			for ( int j = 1; j <= m; j++ ) s += kernel[j] * (taps[j][i] - taps[-j][i]);
+		} else {
+			s = kernel[0] * taps[0][i];
+			for ( int j = 1; j <= m; j++ ) s += kernel[j] * (taps[j][i] + taps[-j][i]);
+		}
+		out[i] = s;
+	}
+}
+
+#ifdef FARNEBACK_SSE2
+// returns how many were done, a multiple of 4
+static int symmetric_sum_sse2(const float* const* taps, const float* kernel, int m, bool odd, int n, float* out){
+	int i = 0;
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128 s = odd ? _mm_setzero_ps() : _mm_mul_ps(_mm_set1_ps(kernel[0]), _mm_loadu_ps(taps[0] + i));
+		for ( int j = 1; j <= m; j++ ) {
+			__m128 hi = _mm_loadu_ps(taps[j] + i);
+			__m128 lo = _mm_loadu_ps(taps[-j] + i);
+			s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(kernel[j]), odd ? _mm_sub_ps(hi, lo) : _mm_add_ps(hi, lo)));
+		}
+		_mm_storeu_ps(out + i, s);
+	}
+	return i;
+}
+#endif
+
+#ifdef FARNEBACK_AVX2
+// As symmetric_sum_sse2, 8 at a time.
+__attribute__((target("avx2")))
+static int symmetric_sum_avx2(const float* const* taps, const float* kernel, int m, bool odd, int n, float* out){
+	int i = 0;
+	for ( ; i + 8 <= n; i += 8 ) {
+		__m256 s = odd ? _mm256_setzero_ps() : _mm256_mul_ps(_mm256_set1_ps(kernel[0]), _mm256_loadu_ps(taps[0] + i));
+		for ( int j = 1; j <= m; j++ ) {
+			__m256 hi = _mm256_loadu_ps(taps[j] + i);
+			__m256 lo = _mm256_loadu_ps(taps[-j] + i);
+			s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_set1_ps(kernel[j]), odd ? _mm256_sub_ps(hi, lo) : _mm256_add_ps(hi, lo)));
+		}
+		_mm256_storeu_ps(out + i, s);
+	}
+	return i;
+}
+#endif
+
+// n - outputs, out[0] to out[n-1]
+static void symmetric_sum(const float* const* taps, const float* kernel, int m, bool odd, int n, float* out){
+	int done = 0;
+#ifdef FARNEBACK_AVX2
+	static const bool avx2 = checkHardwareSupport(CV_CPU_AVX2);
+	if ( avx2 ) done = symmetric_sum_avx2(taps, kernel, m, odd, n, out);
+#endif
+#ifdef FARNEBACK_SSE2
+	if ( done == 0 ) done = symmetric_sum_sse2(taps, kernel, m, odd, n, out);
+#endif
+	symmetric_sum_scalar(taps, kernel, m, odd, done, n, out);
+}
+
+// taps - output: the rows y-m to y+m of src, the edge rows repeated past the edges
+static void row_taps(const Mat& src, int y, int m, const float** taps){
+	for ( int j = -m; j <= m; j++ ) taps[j] = src.ptr<float>(std::min(std::max(y + j, 0), src.rows - 1));
+}
+
+// taps - output: row moved by -m to m pixels of c floats
+static void offset_taps(const float* row, int m, int c, const float** taps){
+	for ( int j = -m; j <= m; j++ ) taps[j] = row + j * c;
+}
+
+// row - n pixels of c floats, with room for pad more on either side that get the edge pixels
+static void replicate_border(float* row, int n, int c, int pad){
+	for ( int x = 0; x < pad * c; x++ ) {
+		row[-1 - x] = row[c - 1 - x];
+		row[n * c + x] = row[n * c + x - c];
+	}
+}
+
+// a, b - whether the pixels are the same, cheap next to expanding a frame
+static bool same_image(const Mat& a, const Mat& b){
+	if ( a.rows != b.rows || a.cols != b.cols || a.type() != b.type() ) return false;
+	size_t bytes = a.cols * a.elemSize();
+	for ( int y = 0; y < a.rows; y++ ) {
+		if ( memcmp(a.ptr(y), b.ptr(y), bytes) ) return false;
+	}
+	return true;
+}
+
+// The second frame of the last call and its expansion, which the engines sharing it pass on to each other.
+struct FarnebackFrame {
+	Mat image;
+	std::vector<Mat> R;	// polynomial expansion of as many levels as that call needed
+};
+
+class CachedFarneback : public DenseOpticalFlow {
+public:
+	CachedFarneback(int levels, double pyr_scale, int winsize, int iterations, int poly_n, double poly_sigma, int flags,
+		const Ptr<FarnebackFrame>& last);
+	void calc(InputArray I0, InputArray I1, InputOutputArray flow);
+	void collectGarbage();
+	const Ptr<FarnebackFrame>& frame() const { return last; }
+
+private:
+	double level_scale(int k) const;
+	void expand(const Mat& image, int bottom, int top, std::vector<Mat>& R);
+	void poly_expand(const Mat& src, Mat& dst) const;
+	void update_matrices(const Mat& R0, const Mat& R1, const Mat& flow, Mat& M) const;
+	void update_flow(Mat& flow, const Mat& M) const;
+
+	int levels;
+	double pyr_scale;
+	int iterations;
+	int flags;
+
+	int poly_n;	// half width of the polynomial fit
+	std::vector<float> g, xg, xxg;	// its weights, from the center out
+	double ig11, ig03, ig33, ig55;	// the inverse of its moment matrix that the fit needs
+	int m;	// half width of the flow update window
+	std::vector<float> window;	// its weights, from the center out
+
+	Ptr<FarnebackFrame> last;	// may be shared with other engines, see create_cached_farneback()
+	std::vector<Mat> R0, R1;	// polynomial expansion of every level of the two frames
+	Mat fimg, blurred, level, M;	// scratch
+};
+
+CachedFarneback::CachedFarneback(int levels, double pyr_scale, int winsize, int iterations, int poly_n, double poly_sigma, int flags,
+	const Ptr<FarnebackFrame>& last) :
+	levels(std::max(levels, 0)), pyr_scale(pyr_scale), iterations(std::max(iterations, 1)), flags(flags),
+	poly_n(std::max(poly_n, 1)), m(std::max(winsize, 1) / 2), last(last) {
+	// the polynomial fit of FarnebackPrepareGaussian()
+	double sigma = poly_sigma < FLT_EPSILON ? this->poly_n * 0.3 : poly_sigma;
+	double s = 0;
+	for ( int x = -this->poly_n; x <= this->poly_n; x++ ) s += exp(-x * x / (2 * sigma * sigma));
+	g.resize(this->poly_n + 1);
+	xg.resize(this->poly_n + 1);
+	xxg.resize(this->poly_n + 1);
+	for ( int x = 0; x <= this->poly_n; x++ ) {
+		g[x] = (float)(exp(-x * x / (2 * sigma * sigma)) / s);
+		xg[x] = x * g[x];
+		xxg[x] = x * x * g[x];
+	}
+
+	Mat G = Mat::zeros(6, 6, CV_64F);
+	for ( int y = -this->poly_n; y <= this->poly_n; y++ ) {
+		for ( int x = -this->poly_n; x <= this->poly_n; x++ ) {
+			double w = (double)g[abs(y)] * g[abs(x)];
+			G.at<double>(0, 0) += w;
+			G.at<double>(1, 1) += w * x * x;
+			G.at<double>(3, 3) += w * x * x * x * x;
+			G.at<double>(5, 5) += w * x * x * y * y;
+		}
+	}
+	G.at<double>(2, 2) = G.at<double>(0, 3) = G.at<double>(0, 4) = G.at<double>(3, 0) = G.at<double>(4, 0) = G.at<double>(1, 1);
+	G.at<double>(4, 4) = G.at<double>(3, 3);
+	G.at<double>(3, 4) = G.at<double>(4, 3) = G.at<double>(5, 5);
+	Mat invG = G.inv(DECOMP_CHOLESKY);
+	ig11 = invG.at<double>(1, 1);
+	ig03 = invG.at<double>(0, 3);
+	ig33 = invG.at<double>(3, 3);
+	ig55 = invG.at<double>(5, 5);
+
+	// the flow update window, gaussian or box
+	window.assign(m + 1, 1.0f);
+	if ( flags & OPTFLOW_FARNEBACK_GAUSSIAN ) {
+		double wsigma = m * 0.3;
+		for ( int i = 1; i <= m; i++ ) window[i] = (float)exp(-i * i / (2 * wsigma * wsigma));
+	}
+	double sum = window[0];
+	for ( int i = 1; i <= m; i++ ) sum += 2 * window[i];
+	for ( int i = 0; i <= m; i++ ) window[i] = (float)(window[i] / sum);
+}
+
+// k - pyramid level, 0 is full size
+double CachedFarneback::level_scale(int k) const {
+	double scale = 1;
+	for ( int i = 0; i < k; i++ ) scale *= pyr_scale;
+	return scale;
+}
+
+// image - a frame
+// bottom - finest level to expand, the ones below it are in R already
+// top - coarsest level
+// R - output: the polynomial expansion of every level, blurred and scaled as calcOpticalFlowFarneback() does
+void CachedFarneback::expand(const Mat& image, int bottom, int top, std::vector<Mat>& R){
+	R.resize(top + 1);
+	if ( bottom > top ) return;
+	image.convertTo(fimg, CV_32F);
+	for ( int k = bottom; k <= top; k++ ) {
+		double scale = level_scale(k);
+		double sigma = (1 / scale - 1) * 0.5;
+		int ksize = std::max(cvRound(sigma * 5) | 1, 3);
+		GaussianBlur(fimg, blurred, Size(ksize, ksize), sigma, sigma);
+		resize(blurred, level, Size(cvRound(image.cols * scale), cvRound(image.rows * scale)), 0, 0, INTER_LINEAR);
+		poly_expand(level, R[k]);
+	}
+}
+
+// src - CV_32FC1 level
+// dst - output: CV_32FC5, the fitted polynomial of every pixel (b and A, without the constant)
+void CachedFarneback::poly_expand(const Mat& src, Mat& dst) const {
+	int n = poly_n;
+	int width = src.cols;
+	dst.create(src.rows, width, CV_32FC(5));
+
+	parallel_for_(Range(0, src.rows), [&](const Range& range) -> void {
+		std::vector<const float*> vtaps(2 * n + 1), htaps(2 * n + 1);
+		std::vector<float> planes(3 * (width + 2 * n));
+		std::vector<float> sums(6 * width);
+		float* p[3];
+		for ( int c = 0; c < 3; c++ ) p[c] = &planes[c * (width + 2 * n) + n];
+		// r1 ~ 1, r2 ~ x, r3 ~ y, r4 ~ x^2, r5 ~ y^2, r6 ~ xy
+		float* b1 = &sums[0];
+		float* b2 = b1 + width;
+		float* b3 = b2 + width;
+		float* b4 = b3 + width;
+		float* b5 = b4 + width;
+		float* b6 = b5 + width;
+
+		for ( int y = range.start; y < range.end; y++ ) {
+			// vertical: the row weighted by 1, y and y^2
+			row_taps(src, y, n, &vtaps[n]);
+			symmetric_sum(&vtaps[n], &g[0], n, false, width, p[0]);
+			symmetric_sum(&vtaps[n], &xg[0], n, true, width, p[1]);
+			symmetric_sum(&vtaps[n], &xxg[0], n, false, width, p[2]);
+			for ( int c = 0; c < 3; c++ ) replicate_border(p[c], width, 1, n);
+
+			// horizontal
+			offset_taps(p[0], n, 1, &htaps[n]);
+			symmetric_sum(&htaps[n], &g[0], n, false, width, b1);
+			symmetric_sum(&htaps[n], &xg[0], n, true, width, b2);
+			symmetric_sum(&htaps[n], &xxg[0], n, false, width, b4);
+			offset_taps(p[1], n, 1, &htaps[n]);
+			symmetric_sum(&htaps[n], &g[0], n, false, width, b3);
+			symmetric_sum(&htaps[n], &xg[0], n, true, width, b6);
+			offset_taps(p[2], n, 1, &htaps[n]);
+			symmetric_sum(&htaps[n], &g[0], n, false, width, b5);
+
+			float* drow = dst.ptr<float>(y);
+			for ( int x = 0; x < width; x++ ) {
+				drow[x*5] = (float)(b3[x] * ig11);
+				drow[x*5+1] = (float)(b2[x] * ig11);
+				drow[x*5+2] = (float)(b1[x] * ig03 + b5[x] * ig33);
+				drow[x*5+3] = (float)(b1[x] * ig03 + b4[x] * ig33);
+				drow[x*5+4] = (float)(b6[x] * ig55);
+			}
+		}
+	});
+}
+
+// R0, R1 - polynomial expansions of the level
+// flow - current estimate
+// M - output: CV_32FC5, the normal equations of every pixel, G11 G12 G22 h1 h2, as FarnebackUpdateMatrices()
+void CachedFarneback::update_matrices(const Mat& R0, const Mat& R1, const Mat& flow, Mat& M) const {
+	static const int BORDER = 5;
+	static const float border[BORDER] = {0.14f, 0.14f, 0.4472f, 0.4472f, 0.4472f};
+	int width = flow.cols, height = flow.rows;
+	M.create(height, width, CV_32FC(5));
+
+	parallel_for_(Range(0, height), [&](const Range& range) -> void {
+		const float* r1 = R1.ptr<float>(0);
+		size_t step1 = R1.step / sizeof(float);
+		for ( int y = range.start; y < range.end; y++ ) {
+			const float* f = flow.ptr<float>(y);
+			const float* r0 = R0.ptr<float>(y);
+			float* mrow = M.ptr<float>(y);
+			for ( int x = 0; x < width; x++ ) {
+				float dx = f[x*2], dy = f[x*2+1];
+				float fx = x + dx, fy = y + dy;
+				int x1 = cvFloor(fx), y1 = cvFloor(fy);
+				float r2, r3, r4, r5, r6;
+				fx -= x1;
+				fy -= y1;
+
+				if ( (unsigned)x1 < (unsigned)(width - 1) && (unsigned)y1 < (unsigned)(height - 1) ) {
+					const float* ptr = r1 + y1 * step1 + x1 * 5;
+					float a00 = (1.f - fx) * (1.f - fy), a01 = fx * (1.f - fy), a10 = (1.f - fx) * fy, a11 = fx * fy;
+					r2 = a00*ptr[0] + a01*ptr[5] + a10*ptr[step1] + a11*ptr[step1+5];
+					r3 = a00*ptr[1] + a01*ptr[6] + a10*ptr[step1+1] + a11*ptr[step1+6];
+					r4 = a00*ptr[2] + a01*ptr[7] + a10*ptr[step1+2] + a11*ptr[step1+7];
+					r5 = a00*ptr[3] + a01*ptr[8] + a10*ptr[step1+3] + a11*ptr[step1+8];
+					r6 = a00*ptr[4] + a01*ptr[9] + a10*ptr[step1+4] + a11*ptr[step1+9];
+					r4 = (r0[x*5+2] + r4) * 0.5f;
+					r5 = (r0[x*5+3] + r5) * 0.5f;
+					r6 = (r0[x*5+4] + r6) * 0.25f;
+				} else {
+					r2 = r3 = 0.f;
+					r4 = r0[x*5+2];
+					r5 = r0[x*5+3];
+					r6 = r0[x*5+4] * 0.5f;
+				}
+				r2 = (r0[x*5] - r2) * 0.5f;
+				r3 = (r0[x*5+1] - r3) * 0.5f;
+				r2 += r4 * dy + r6 * dx;
+				r3 += r6 * dy + r5 * dx;
+
+				// the fit is poor near the edges, trust it less there
+				if ( (unsigned)(x - BORDER) >= (unsigned)(width - BORDER*2) || (unsigned)(y - BORDER) >= (unsigned)(height - BORDER*2) ) {
+					float scale = (x < BORDER ? border[x] : 1.f) *
+						(x >= width - BORDER ? border[width - x - 1] : 1.f) *
+						(y < BORDER ? border[y] : 1.f) *
+						(y >= height - BORDER ? border[height - y - 1] : 1.f);
+					r2 *= scale; r3 *= scale; r4 *= scale; r5 *= scale; r6 *= scale;
+				}
+
+				mrow[x*5] = r4*r4 + r6*r6;	// G(1,1)
+				mrow[x*5+1] = (r4 + r5)*r6;	// G(1,2)=G(2,1)
+				mrow[x*5+2] = r5*r5 + r6*r6;	// G(2,2)
+				mrow[x*5+3] = r4*r2 + r6*r3;	// h(1)
+				mrow[x*5+4] = r6*r2 + r5*r3;	// h(2)
+			}
+		}
+	});
+}
+
+// flow - output: solved from the window sums of M
+// M - from update_matrices()
+void CachedFarneback::update_flow(Mat& flow, const Mat& M) const {
+	int width = flow.cols, height = flow.rows;
+
+	parallel_for_(Range(0, height), [&](const Range& range) -> void {
+		std::vector<const float*> vtaps(2 * m + 1), htaps(2 * m + 1);
+		std::vector<float> vbuf((width + 2 * m) * 5), hsum(width * 5);
+		float* vsum = &vbuf[m * 5];
+		offset_taps(vsum, m, 5, &htaps[m]);
+
+		for ( int y = range.start; y < range.end; y++ ) {
+			row_taps(M, y, m, &vtaps[m]);
+			symmetric_sum(&vtaps[m], &window[0], m, false, width * 5, vsum);
+			replicate_border(vsum, width, 5, m);
+			symmetric_sum(&htaps[m], &window[0], m, false, width * 5, &hsum[0]);
+
+			float* f = flow.ptr<float>(y);
+			for ( int x = 0; x < width; x++ ) {
+				float g11 = hsum[x*5], g12 = hsum[x*5+1], g22 = hsum[x*5+2], h1 = hsum[x*5+3], h2 = hsum[x*5+4];
+				double idet = 1. / (g11*g22 - g12*g12 + 1e-3);
+				f[x*2] = (float)((g11*h2 - g12*h1) * idet);
+				f[x*2+1] = (float)((g22*h1 - g12*h2) * idet);
+			}
+		}
+	});
+}
+
+void CachedFarneback::calc(InputArray _I0, InputArray _I1, InputOutputArray _flow){
+	Mat I0 = _I0.getMat(), I1 = _I1.getMat();
+	CV_Assert( I0.rows == I1.rows && I0.cols == I1.cols && I0.type() == I1.type() && I0.channels() == 1 );
+
+	// as many levels as stay over FARNEBACK_MIN_SIZE
+	int top = 0;
+	for ( double scale = pyr_scale; top < levels; top++, scale *= pyr_scale ) {
+		if ( I0.cols * scale < FARNEBACK_MIN_SIZE || I0.rows * scale < FARNEBACK_MIN_SIZE ) break;
+	}
+
+	// the coarsest level starts from zero, or the flow handed in
+	Mat flow;
+	double scale = level_scale(top);
+	Size coarsest(cvRound(I0.cols * scale), cvRound(I0.rows * scale));
+	if ( (flags & OPTFLOW_USE_INITIAL_FLOW) && _flow.rows() == I0.rows && _flow.cols() == I0.cols && _flow.type() == CV_32FC2 ) {
+		resize(_flow.getMat(), flow, coarsest, 0, 0, INTER_AREA);
+		flow *= scale;
+	} else {
+		flow = Mat::zeros(coarsest, CV_32FC2);
+	}
+
+	// a video hands in the last call's second frame first, its expansion is kept;
+	// the last call may have been another engine's with fewer levels, only the missing ones are expanded
+	if ( same_image(I0, last->image) ) {
+		std::swap(R0, last->R);
+		expand(I0, (int)R0.size(), top, R0);
+	} else {
+		expand(I0, 0, top, R0);
+	}
+	expand(I1, 0, top, R1);
+
+	for ( int k = top; k >= 0; k-- ) {
+		if ( k < top ) {
+			Mat coarse = flow;
+			flow = Mat();
+			resize(coarse, flow, R0[k].size(), 0, 0, INTER_LINEAR);
+			flow *= 1. / pyr_scale;
+		}
+		// all rows of the flow are updated from the last matrices, then all matrices from the new flow
+		update_matrices(R0[k], R1[k], flow, M);
+		for ( int i = 0; i < iterations; i++ ) {
+			update_flow(flow, M);
+			if ( i < iterations - 1 ) update_matrices(R0[k], R1[k], flow, M);
+		}
+	}
+	flow.copyTo(_flow);
+
+	// the vectors only ever trade places, so no two of them share a level
+	I1.copyTo(last->image);
+	std::swap(R1, last->R);
+}
+
+void CachedFarneback::collectGarbage(){
+	last->image.release();
+	last->R.clear();
+	R0.clear();
+	R1.clear();
+	fimg.release();
+	blurred.release();
+	level.release();
+	M.release();
+}
+
+Ptr<DenseOpticalFlow> create_cached_farneback(int levels, double pyr_scale, int winsize, int iterations,
+	int poly_n, double poly_sigma, int flags, const Ptr<DenseOpticalFlow>& share){
+	CachedFarneback* other = dynamic_cast<CachedFarneback*>(share.get());
+	Ptr<FarnebackFrame> last = other ? other->frame() : makePtr<FarnebackFrame>();
+	return makePtr<CachedFarneback>(levels, pyr_scale, winsize, iterations, poly_n, poly_sigma, flags, last);
+}
@@ -0,0 +1,21 @@
+#ifndef __FARNEBACK_HPP_INCLUDE__
+#define __FARNEBACK_HPP_INCLUDE__
+
+#include <opencv2/opencv.hpp>
+
+#define FARNEBACK_MIN_SIZE 32 // coarser pyramid levels than this are skipped, as calcOpticalFlowFarneback() does
+
+// Dense Farneback flow that keeps the pyramid and polynomial expansion of its second frame,
+// so when the next call's first frame is that frame, as it is for a video, only the new
+// frame is expanded. Separable filters are SSE2/AVX2 and every pass runs in row stripes.
+// The flow of a level is updated for all rows before the matrices are, instead of row by row
+// as OpenCV does, so the fields differ from calcOpticalFlowFarneback() by a little.
+// Same parameters as FarnebackOpticalFlow::create(), flags takes OPTFLOW_USE_INITIAL_FLOW
+// and OPTFLOW_FARNEBACK_GAUSSIAN.
+// share - another engine from here with the same pyr_scale, poly_n and poly_sigma that takes turns with this one
+// on the same frames, as the warm and cold engines of a warm start do; they keep the last frame in one place,
+// so whichever runs next finds it expanded. Empty, or any other engine, for a cache of its own.
+cv::Ptr<cv::DenseOpticalFlow> create_cached_farneback(int levels, double pyr_scale, int winsize, int iterations,
+	int poly_n, double poly_sigma, int flags, const cv::Ptr<cv::DenseOpticalFlow>& share);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "flow_cache.hpp"
+
+using namespace cv;
+
+// bytes of one frame in a cache of flow at size, or of a grid x grid grid flow
+static size_t record_bytes(Size size, int grid){
+	size_t vectors = grid > 0 ? (size_t)grid * grid : (size_t)size.area();
+	return sizeof(FlowCacheRecord) + vectors * 2 * sizeof(float);
+}
+
+// cache - output: open for write_flow_cache()
+// name - file to write, replaced if it is there
+// size - analysis resolution, every flow is this size
+// grid - GRID_COUNT when only the sparse grid flow is kept, 0 for the dense flow
+// returns false if the file can not be written
+bool create_flow_cache(FlowCache& cache, const String& name, Size size, int grid){
+	cache.size = size;
+	cache.grid = grid;
+	cache.record_bytes = record_bytes(size, grid);
+	cache.map = NULL;
+	cache.length = 0;
+	cache.frames = 0;
+	cache.source_frames = 0;
+
+	cache.file = fopen(name.c_str(), "wb");
+	if ( !cache.file ) return false;
+
+	FlowCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FLOW_CACHE_MAGIC, sizeof(header.magic));
+	header.width = size.width;
+	header.height = size.height;
+	header.grid = grid;
+	return fwrite(&header, sizeof(header), 1, cache.file) == 1;
+}
+
+// Appends a frame, the flow as it came from the flow stage, before the analysis rescales it.
+// flow - CV_32FC2 at cache.size, ignored for a grid cache
+// grid_flow - CV_32FC2 grid x grid, ignored for a dense cache
+// returns false when the write failed, the disk is full
+bool write_flow_cache(FlowCache& cache, const FlowCacheRecord& record, const Mat& flow, const Mat& grid_flow){
+	if ( fwrite(&record, sizeof(record), 1, cache.file) != 1 ) return false;
+
+	if ( cache.grid > 0 ) {
+		CV_Assert(grid_flow.type() == CV_32FC2 && grid_flow.rows == cache.grid && grid_flow.cols == cache.grid);
+		Mat grid = grid_flow.isContinuous() ? grid_flow : grid_flow.clone();
+		if ( fwrite(grid.ptr(), grid.total() * grid.elemSize(), 1, cache.file) != 1 ) return false;
+	} else {
+		CV_Assert(flow.type() == CV_32FC2 && flow.size() == cache.size);
+		// row by row, the flow may be a region of a larger field
+		size_t row_bytes = (size_t)flow.cols * flow.elemSize();
+		for ( int y = 0; y < flow.rows; y++ ) {
+			if ( fwrite(flow.ptr(y), row_bytes, 1, cache.file) != 1 ) return false;
+		}
+	}
+	cache.frames++;
+	cache.source_frames = record.source_frame + 1;
+	return true;
+}
+
+// Maps a cache for read_flow_cache(), read only: the pages are the file's own in the page cache,
+// dropped again under memory pressure, so a replay of any length stays at the size of the analysis.
+// A cache whose writer did not finish ends at its last whole record.
+// returns false if it is not a flow cache
+bool open_flow_cache(FlowCache& cache, const String& name){
+	cache.file = NULL;
+	cache.map = NULL;
+	cache.length = 0;
+	cache.frames = 0;
+	cache.source_frames = 0;
+
+	int fd = open(name.c_str(), O_RDONLY);
+	if ( fd < 0 ) return false;
+	struct stat info;
+	if ( fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FlowCacheHeader) ) { ::close(fd); return false; }
+	cache.length = info.st_size;
+	void* map = mmap(NULL, cache.length, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);	// the mapping keeps the file
+	if ( map == MAP_FAILED ) return false;
+	cache.map = (unsigned char*)map;
+	// replay goes front to back, the kernel can read ahead
+	madvise(map, cache.length, MADV_SEQUENTIAL);
+
+	const FlowCacheHeader* header = (const FlowCacheHeader*)cache.map;
+	if ( memcmp(header->magic, FLOW_CACHE_MAGIC, sizeof(header->magic)) || header->width <= 0 || header->height <= 0 || header->grid < 0 ) {
+		close_flow_cache(cache);
+		return false;
+	}
+	cache.size = Size(header->width, header->height);
+	cache.grid = header->grid;
+	cache.record_bytes = record_bytes(cache.size, cache.grid);
+	cache.frames = (int)((cache.length - sizeof(FlowCacheHeader)) / cache.record_bytes);
+
+	FlowCacheRecord last;
+	Mat flow, grid_flow;
+	if ( cache.frames > 0 && read_flow_cache(cache, cache.frames - 1, last, flow, grid_flow) ) cache.source_frames = last.source_frame + 1;
+	return true;
+}
+
+// index - frame in the cache, 0 to cache.frames - 1
+// record - output: frame numbers, time and dt
+// flow - output: CV_32FC2 at cache.size, pointing into the mapping, no copy; read only, writing to it faults;
+// empty for a grid cache
+// grid_flow - output: the same for the grid flow, empty for a dense cache
+// returns false past the end
+bool read_flow_cache(const FlowCache& cache, int index, FlowCacheRecord& record, Mat& flow, Mat& grid_flow){
+	if ( index < 0 || index >= cache.frames ) return false;
+	unsigned char* data = cache.map + sizeof(FlowCacheHeader) + (size_t)index * cache.record_bytes;
+	memcpy(&record, data, sizeof(record));
+	data += sizeof(record);
+	if ( cache.grid > 0 ) {
+		flow.release();
+		grid_flow = Mat(cache.grid, cache.grid, CV_32FC2, data);
+	} else {
+		flow = Mat(cache.size, CV_32FC2, data);
+		grid_flow.release();
+	}
+	return true;
+}
+
+// Closes either kind, the Mats from read_flow_cache() are invalid after this
+void close_flow_cache(FlowCache& cache){
+	if ( cache.file ) fclose(cache.file);
+	if ( cache.map ) munmap(cache.map, cache.length);
+	cache.file = NULL;
+	cache.map = NULL;
+	cache.length = 0;
+	cache.frames = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef __FLOW_CACHE_HPP_INCLUDE__
+#define __FLOW_CACHE_HPP_INCLUDE__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <opencv2/opencv.hpp>
+
+// A flow cache is every analyzed frame's raw CV_32FC2 flow, as the flow stage left it, in one file:
+// a FlowCacheHeader, then one record per frame, all of the same length, so frame i is found without
+// reading the ones before it. A record is a FlowCacheRecord and height x width flow vectors row by row,
+// or for the sparse flow only its grid x grid grid vectors. Native byte order, it is meant for the machine
+// that made it. Replaying one maps the file read only and runs the analysis on it without decoding or flow.
+
+#define FLOW_CACHE_MAGIC "RIPFLOW1"
+
+struct FlowCacheHeader {
+	char magic[8];
+	int32_t width;
+	int32_t height;
+	int32_t grid;	// GRID_COUNT for the sparse flow, 0 for a dense one
+	int32_t reserved;
+};
+
+struct FlowCacheRecord {
+	int32_t framecount;
+	int32_t source_frame;
+	double time;
+	float dt;
+	int32_t reserved;
+};
+
+struct FlowCache {
+	cv::Size size;	// of the flow
+	int grid;	// as in the header
+	size_t record_bytes;	// header, flow and grid flow of a frame
+
+	FILE* file;	// writing: records go to the end
+	unsigned char* map;	// replaying: the whole file
+	size_t length;
+	int frames;	// records in the map
+	int source_frames;	// source_frame of the last one plus one
+};
+
+bool create_flow_cache(FlowCache& cache, const cv::String& name, cv::Size size, int grid);
+bool write_flow_cache(FlowCache& cache, const FlowCacheRecord& record, const cv::Mat& flow, const cv::Mat& grid_flow);
+bool open_flow_cache(FlowCache& cache, const cv::String& name);
+bool read_flow_cache(const FlowCache& cache, int index, FlowCacheRecord& record, cv::Mat& flow, cv::Mat& grid_flow);
+void close_flow_cache(FlowCache& cache);
+
+#endif
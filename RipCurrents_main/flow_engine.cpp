@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/optflow.hpp>
+
+#include "flow_engine.hpp"
+#include "farneback.hpp"
+
+using namespace cv;
+
+FlowParams::FlowParams() : engine(FLOW_FARNEBACK),
+	pyr_scale(0.5), levels(2), winsize(3), iterations(2), poly_n(15), poly_sigma(1.2), flags(OPTFLOW_FARNEBACK_GAUSSIAN),
+	finest_scale(-1), patch_size(-1), patch_stride(-1), gradient_iterations(-1), refinement_iterations(-1),
+	warm_start(false), warm_levels(-1), warm_iterations(-1), warm_refresh(FLOW_WARM_REFRESH) {}
+
+static const char* engine_names[] = {"farneback", "dis-ultrafast", "dis-fast", "dis-medium", "lk", "farneback-cached"};
+
+const char* flow_engine_name(int engine){
+	return engine >= 0 && engine < FLOW_ENGINES ? engine_names[engine] : "unknown";
+}
+
+// name - farneback, farneback-cached, dis-ultrafast, dis-fast, dis-medium or lk
+// returns false for an unknown name
+bool parse_flow_engine(const char* name, FlowParams& params){
+	for ( int engine = 0; engine < FLOW_ENGINES; engine++ ) {
+		if ( !strcmp(name, engine_names[engine]) ) {
+			params.engine = engine;
+			return true;
+		}
+	}
+	return false;
+}
+
+// list - comma separated name=value, e.g. levels=3,winsize=15
+// returns false for an unknown name or a missing value
+bool parse_flow_params(const char* list, FlowParams& params){
+	std::string rest = list;
+	while ( !rest.empty() ) {
+		size_t comma = rest.find(',');
+		std::string item = rest.substr(0, comma);
+		rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+		if ( item.empty() ) continue;
+
+		size_t equals = item.find('=');
+		if ( equals == std::string::npos ) return false;
+		std::string name = item.substr(0, equals);
+		const char* value = item.c_str() + equals + 1;
+
+		if ( name == "pyr_scale" ) params.pyr_scale = atof(value);
+		else if ( name == "levels" ) params.levels = atoi(value);
+		else if ( name == "winsize" ) params.winsize = atoi(value);
+		else if ( name == "iterations" ) params.iterations = atoi(value);
+		else if ( name == "poly_n" ) params.poly_n = atoi(value);
+		else if ( name == "poly_sigma" ) params.poly_sigma = atof(value);
+		else if ( name == "gaussian" ) {
+			if ( atoi(value) ) params.flags |= OPTFLOW_FARNEBACK_GAUSSIAN;
+			else params.flags &= ~OPTFLOW_FARNEBACK_GAUSSIAN;
+		}
+		else if ( name == "finest_scale" ) params.finest_scale = atoi(value);
+		else if ( name == "patch_size" ) params.patch_size = atoi(value);
+		else if ( name == "patch_stride" ) params.patch_stride = atoi(value);
+		else if ( name == "gradient_iterations" ) params.gradient_iterations = atoi(value);
+		else if ( name == "refinement_iterations" ) params.refinement_iterations = atoi(value);
+		else if ( name == "warm_levels" ) params.warm_levels = atoi(value);
+		else if ( name == "warm_iterations" ) params.warm_iterations = atoi(value);
+		else if ( name == "warm_refresh" ) params.warm_refresh = atoi(value);
+		else return false;
+	}
+	return true;
+}
+
+Ptr<DenseOpticalFlow> create_flow_engine(const FlowParams& params, bool warm, const Ptr<DenseOpticalFlow>& share){
+	if ( params.engine == FLOW_SPARSE_LK ) return Ptr<DenseOpticalFlow>();
+
+	if ( params.engine == FLOW_FARNEBACK || params.engine == FLOW_FARNEBACK_CACHED ) {
+		int levels = params.levels;
+		int iterations = params.iterations;
+		int flags = params.flags;
+		if ( warm ) {
+			levels = params.warm_levels >= 0 ? params.warm_levels : std::max(levels - 1, 0);
+			iterations = params.warm_iterations > 0 ? params.warm_iterations : std::max(iterations / 2, 1);
+			flags |= OPTFLOW_USE_INITIAL_FLOW;
+		}
+		if ( params.engine == FLOW_FARNEBACK_CACHED )
+			return create_cached_farneback(levels, params.pyr_scale, params.winsize, iterations,
+				params.poly_n, params.poly_sigma, flags, share);
+		// same argument order as calcOpticalFlowFarneback(), which runs on UMats through OpenCL when it can
+		return FarnebackOpticalFlow::create(levels, params.pyr_scale, false, params.winsize, iterations,
+			params.poly_n, params.poly_sigma, flags);
+	}
+
+	int preset = optflow::DISOpticalFlow::PRESET_FAST;
+	if ( params.engine == FLOW_DIS_ULTRAFAST ) preset = optflow::DISOpticalFlow::PRESET_ULTRAFAST;
+	else if ( params.engine == FLOW_DIS_MEDIUM ) preset = optflow::DISOpticalFlow::PRESET_MEDIUM;
+	Ptr<optflow::DISOpticalFlow> dis = optflow::createOptFlow_DIS(preset);
+	if ( params.finest_scale >= 0 ) dis->setFinestScale(params.finest_scale);
+	if ( params.patch_size > 0 ) dis->setPatchSize(params.patch_size);
+	if ( params.patch_stride > 0 ) dis->setPatchStride(params.patch_stride);
+	if ( params.gradient_iterations > 0 ) dis->setGradientDescentIterations(params.gradient_iterations);
+	if ( params.refinement_iterations >= 0 ) dis->setVariationalRefinementIterations(params.refinement_iterations);
+	// DIS takes any flow of the right size it is handed as the initial one, warm or not;
+	// warm it just needs fewer descent steps from there
+	if ( warm ) {
+		int iterations = dis->getGradientDescentIterations();
+		dis->setGradientDescentIterations(params.warm_iterations > 0 ? params.warm_iterations : std::max(iterations / 2, 1));
+	}
+	return dis;
+}
@@ -0,0 +1,63 @@
+#ifndef __FLOW_ENGINE_HPP_INCLUDE__
+#define __FLOW_ENGINE_HPP_INCLUDE__
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+// Optical flow backends
+#define FLOW_FARNEBACK 0 // dense Farneback, what the program always used
+#define FLOW_DIS_ULTRAFAST 1 // DIS presets, much cheaper and a little less accurate
+#define FLOW_DIS_FAST 2
+#define FLOW_DIS_MEDIUM 3
+#define FLOW_SPARSE_LK 4 // pyramidal LK at the arrow grid only, see compute_sparse_flow()
+#define FLOW_FARNEBACK_CACHED 5 // Farneback that expands every frame once, see farneback.hpp
+#define FLOW_ENGINES 6
+
+#define FLOW_WARM_REFRESH 60 // default frames between full cold starts of a warm started flow
+#define FLOW_LK_LEVELS 3 // pyramid levels of the sparse LK
+#define FLOW_LK_WARM_LEVELS 1 // and with a warm start, which only has to correct the last field
+
+// Which backend computes the flow, and its parameters.
+// Parameters left at -1 keep the defaults of the backend or DIS preset.
+struct FlowParams {
+	FlowParams();
+
+	int engine;	// FLOW_
+
+	// Farneback and the cached Farneback, defaults are the ones the program always used
+	double pyr_scale;
+	int levels;
+	int winsize;
+	int iterations;
+	int poly_n;
+	double poly_sigma;
+	int flags;
+
+	// DIS
+	int finest_scale;
+	int patch_size;
+	int patch_stride;
+	int gradient_iterations;
+	int refinement_iterations;	// variational refinement
+
+	// Warm start: each field starts from the last one, which the slow currents barely change,
+	// so a cheaper engine gets as far. Only for flow computed in frame order.
+	bool warm_start;
+	int warm_levels;	// Farneback levels when warm, -1 for one less than levels
+	int warm_iterations;	// Farneback iterations, DIS gradient descent iterations when warm; -1 for half
+	int warm_refresh;	// a cold start every this many frames so errors can not pile up, 0 for never
+};
+
+bool parse_flow_engine(const char* name, FlowParams& params);
+bool parse_flow_params(const char* list, FlowParams& params);
+const char* flow_engine_name(int engine);
+
+// A new engine for params, one per thread, engines keep buffers between calls.
+// warm - the cheaper engine that takes the last field as its initial flow
+// share - an engine of the same params that takes turns with this one on the same frames, or empty;
+// the cached Farneback ones then keep the last frame's expansion in one place, see create_cached_farneback()
+// Empty for FLOW_SPARSE_LK, which is not a dense engine.
+cv::Ptr<cv::DenseOpticalFlow> create_flow_engine(const FlowParams& params, bool warm, const cv::Ptr<cv::DenseOpticalFlow>& share);
+
+#endif
@@ -0,0 +1,74 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "histogram.hpp"
+
+ThresholdHistogram::ThresholdHistogram() : mode(THRESHOLDS_WINDOW), frames(1), next(0) {
+	clear();
+}
+
+void ThresholdHistogram::clear(){
+	memset(hist, 0, sizeof(hist));
+	memset(hist2d, 0, sizeof(hist2d));
+	memset(histsum2d, 0, sizeof(histsum2d));
+	histsum = 0;
+}
+
+// mode - THRESHOLDS_WINDOW or THRESHOLDS_DECAY
+// frames - window length, or time constant of the decay
+void ThresholdHistogram::init(int mode, int frames){
+	this->mode = mode;
+	this->frames = std::max(frames, 1);
+	next = 0;
+	clear();
+	if ( mode == THRESHOLDS_WINDOW ) ring.assign((size_t)this->frames * HIST_DIRECTIONS * HIST_BINS, 0);
+	else ring.clear();
+	ring_dt.assign(mode == THRESHOLDS_WINDOW ? this->frames : 0, 0);
+}
+
+// frame2d - counts of one frame, HIST_DIRECTIONS x HIST_BINS
+// dt - source frames since the last one; the decay runs on that, and in the window the counts of
+// a frame weigh that much, so a stride does not change how much of the thresholds a stretch of video is
+void ThresholdHistogram::add_frame(int frame2d[HIST_DIRECTIONS][HIST_BINS], float dt){
+	if ( mode == THRESHOLDS_DECAY ) {
+		// the sums settle at about frames / dt times the pixels of a frame
+		double keep = pow(1.0 - 1.0 / frames, dt);
+		histsum = 0;
+		for ( int bin = 0; bin < HIST_BINS; bin++ ) hist[bin] *= keep;
+		for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+			double sum = 0;
+			for ( int bin = 0; bin < HIST_BINS; bin++ ) {
+				hist2d[angle][bin] = hist2d[angle][bin] * keep + frame2d[angle][bin];
+				hist[bin] += frame2d[angle][bin];
+				sum += hist2d[angle][bin];
+			}
+			histsum2d[angle] = sum;
+			histsum += sum;
+		}
+		return;
+	}
+
+	// swap the new frame in for the oldest one, the sums are exact integers while the dts are whole frames
+	int* slot = &ring[(size_t)next * HIST_DIRECTIONS * HIST_BINS];
+	double out = ring_dt[next];
+	for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+		int* old = slot + angle * HIST_BINS;
+		double change = 0;
+		for ( int bin = 0; bin < HIST_BINS; bin++ ) {
+			double delta = frame2d[angle][bin] * (double)dt - old[bin] * out;
+			hist2d[angle][bin] += delta;
+			hist[bin] += delta;
+			change += delta;
+			old[bin] = frame2d[angle][bin];
+		}
+		histsum2d[angle] += change;
+		histsum += change;
+	}
+	ring_dt[next] = dt;
+	next = (next + 1) % frames;
+}
+
+void ThresholdHistogram::thresholds(float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]){
+	histogram_thresholds(hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+}
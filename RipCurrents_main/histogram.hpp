@@ -0,0 +1,41 @@
+#ifndef __HISTOGRAM_HPP_INCLUDE__
+#define __HISTOGRAM_HPP_INCLUDE__
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "ripcurrents.hpp"
+
+// How ThresholdHistogram forgets old frames
+#define THRESHOLDS_WINDOW 0 // counts of the last n frames, each weighed by the source frames it stands for
+#define THRESHOLDS_DECAY 1 // every frame weighs 1-1/n of the one after it, per source frame between them
+
+// Flow magnitude histograms behind UPPER/UPPER2d for streams of any length.
+// Only a bounded amount of the past is kept, so the counts stay bounded and
+// the thresholds keep following the water instead of freezing or overflowing.
+// Memory is fixed at init(), a frame costs O(HIST_DIRECTIONS * HIST_BINS),
+// and the threshold queries are O(HIST_DIRECTIONS * HIST_BINS) too.
+class ThresholdHistogram {
+public:
+	ThresholdHistogram();
+	void init(int mode, int frames);	// THRESHOLDS_ mode, window length or time constant in frames
+	void add_frame(int frame2d[HIST_DIRECTIONS][HIST_BINS], float dt);	// counts of one frame, dt source frames after the last
+	void thresholds(float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]);
+
+	double hist[HIST_BINS];
+	double histsum;
+	double hist2d[HIST_DIRECTIONS][HIST_BINS];
+	double histsum2d[HIST_DIRECTIONS];
+
+private:
+	void clear();
+
+	int mode;
+	int frames;
+	std::vector<int> ring;	// THRESHOLDS_WINDOW: frames x HIST_DIRECTIONS x HIST_BINS counts
+	std::vector<float> ring_dt;	// and the dt of each of those frames
+	int next;	// slot of the oldest frame in ring
+};
+
+#endif
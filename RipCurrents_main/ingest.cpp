@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "ingest.hpp"
+
+using namespace cv;
+
+// name - video file, or a uri such as rtsp://camera/stream
+// size - analysis resolution
+// luma - ask for gray instead of bgr
+// returns a GStreamer pipeline that scales the decoded frames in their own yuv and only converts
+// the small ones, or an empty string for names it can not quote
+static String gstreamer_pipeline(const String& name, Size size, bool luma){
+	if ( strchr(name.c_str(), '"') ) return String();
+	String source = strstr(name.c_str(), "://") ? "uridecodebin uri=\"" + name + "\"" : "filesrc location=\"" + name + "\" ! decodebin";
+	// the size already follows the aspect ratio, or was asked for, so no borders
+	char caps[160];
+	snprintf(caps, sizeof(caps), " ! videoscale add-borders=false ! video/x-raw,width=%d,height=%d,pixel-aspect-ratio=1/1"
+		" ! videoconvert ! video/x-raw,format=%s ! appsink", size.width, size.height, luma ? "GRAY8" : "BGR");
+	return source + caps;
+}
+
+// source - output: the video and how its frames come
+// video - the video as opened plainly; handed over, or released for a scaling one
+// name - video file or uri, "-" for the camera
+// size - analysis resolution
+// color - whether any product needs the bgr frame
+// mode - INGEST_PLAIN or INGEST_DECODER
+// returns whether the decoder scales, the source works either way
+bool open_source(VideoSource& source, VideoCapture& video, const String& name, Size size, bool color, int mode){
+	source.size = size;
+	source.color = color;
+	source.scaled = false;
+	source.luma = false;
+
+	if ( mode == INGEST_DECODER && name == "-" ) {
+		// a camera with a mode at the analysis size sends no more than that
+		video.set(CAP_PROP_FRAME_WIDTH, size.width);
+		video.set(CAP_PROP_FRAME_HEIGHT, size.height);
+		source.scaled = (int)video.get(CAP_PROP_FRAME_WIDTH) == size.width && (int)video.get(CAP_PROP_FRAME_HEIGHT) == size.height;
+	} else if ( mode == INGEST_DECODER ) {
+		String pipeline = gstreamer_pipeline(name, size, !color);
+		VideoCapture scaled;
+		if ( !pipeline.empty() && scaled.open(pipeline, CAP_GSTREAMER) ) {
+			video.release();
+			source.video = scaled;
+			source.scaled = true;
+			source.luma = !color;
+			return true;
+		}
+	}
+	source.video = video;
+	return source.scaled;
+}
+
+// source - what the frames look like
+// frame - a decoded frame, as read from source.video
+// subframe - output: bgr at the analysis size, empty when no product needs color
+// gray - output: gray at the analysis size
+// Frames the decoder did not scale after all, a camera without the mode, are resized here.
+void convert_frame(const VideoSource& source, Mat& frame, Mat& subframe, Mat& gray){
+	if ( frame.size() != source.size ) resize(frame, frame, source.size, 0, 0, INTER_LINEAR);
+	if ( frame.channels() == 1 ) {
+		gray = frame;
+		if ( source.color ) cvtColor(frame, subframe, COLOR_GRAY2BGR);
+		else subframe.release();
+		return;
+	}
+	cvtColor(frame, gray, COLOR_BGR2GRAY);
+	if ( source.color ) subframe = frame;
+	else subframe.release();
+}
@@ -0,0 +1,23 @@
+#ifndef __INGEST_HPP_INCLUDE__
+#define __INGEST_HPP_INCLUDE__
+
+#include <opencv2/opencv.hpp>
+
+// How frames get from the video to the analysis resolution
+#define INGEST_PLAIN 0 // the backend decodes full frames to bgr, resize and cvtColor do the rest
+#define INGEST_DECODER 1 // the decoder is asked for frames at the analysis size, plain where it can not
+
+// Where the analyzed frames come from.
+// Skipped frames are only ever grabbed, see decode_frame().
+struct VideoSource {
+	cv::VideoCapture video;
+	cv::Size size;	// analysis resolution
+	bool color;	// some product needs the bgr frame, otherwise only gray is made
+	bool scaled;	// the backend already hands over frames at size
+	bool luma;	// and as gray only
+};
+
+bool open_source(VideoSource& source, cv::VideoCapture& video, const cv::String& name, cv::Size size, bool color, int mode);
+void convert_frame(const VideoSource& source, cv::Mat& frame, cv::Mat& subframe, cv::Mat& gray);
+
+#endif
@@ -1,7 +1,9 @@
 #include <math.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <string>
+#include <string.h>
 #include <math.h>
 
 #include <opencv2/opencv.hpp>
@@ -9,6 +11,8 @@
 #include <opencv2/optflow/motempl.hpp>
 
 #include "ripcurrents.hpp"
+#include "pipeline.hpp"
+#include "timing.hpp"
 
 String type2str(int type) {
   String r;
@@ -34,21 +38,306 @@ String type2str(int type) {
 }
 
 
+void usage(){
+	printf("Usage: ripcurrents [options] <video|-> [output name]\n");
+	printf("  -i, --input <video|->         input video, - for the camera\n");
+	printf("  -o, --output <name>           output name, products go to <name>0.mp4 ... <name>4.mp4 (default output)\n");
+	printf("  -W, --width <px>              analysis width (default %d)\n", DEFAULT_XDIM);
+	printf("      --height <px>             analysis height (default: follows the aspect ratio of the input)\n");
+	printf("      --products <list>         comma separated products to show and encode: streamlines,vector,hsv,edges,field\n");
+	printf("                                or all (default streamlines,vector,hsv)\n");
+	printf("      --encode <list>           products to encode, default those of --products; the ones neither shown\n");
+	printf("                                nor encoded are not computed\n");
+	printf("      --encode-policy <policy>  with the encoder queue full: block, or drop the frame (default block)\n");
+	printf("      --encode-queue <n>        frames waiting per encoder thread (default %d)\n", ENCODE_QUEUE);
+	printf("      --average <mode>          temporal averaging: box (last %d frames) or ema (default box)\n", BUFFER_FRAME);
+	printf("      --time-constant <frames>  time constant of --average ema (default %d)\n", BUFFER_FRAME / 2);
+	printf("      --thresholds <mode>       how the speed thresholds forget old frames: window or decay (default window)\n");
+	printf("      --threshold-frames <n>    window length or decay time constant of --thresholds (default %d)\n", BUFFER_FRAME);
+	printf("      --particles <n>           number of discrete streamline particles (default %d)\n", DEFAULT_PARTICLES);
+	printf("      --seeding <mode>          where particles start: grid or random (default grid)\n");
+	printf("      --respawn <mode>          particles that leave the frame: never come back, or dead ones are reseeded (default never)\n");
+	printf("      --max-age <frames>        with --respawn dead, reseed particles this old too (default 0, never)\n");
+	printf("      --flow <engine>           optical flow backend: farneback, farneback-cached, dis-ultrafast,\n");
+	printf("                                dis-fast, dis-medium or lk (default farneback)\n");
+	printf("      --flow-params <k=v,...>   backend parameters: pyr_scale, levels, winsize, iterations, poly_n, poly_sigma (farneback);\n");
+	printf("                                finest_scale, patch_size, patch_stride, gradient_iterations, refinement_iterations (dis);\n");
+	printf("                                warm_levels, warm_iterations, warm_refresh (--warm-start)\n");
+	printf("      --warm-start              start every flow field from the last one, with fewer levels or iterations\n");
+	printf("      --mask <file|auto>        analyze only the water: an image (nonzero on water), a text file of polygons\n");
+	printf("                                (x y per line, input video pixels, blank line between polygons), or auto\n");
+	printf("                                to find it in the average of the first %d frames\n", MASK_AUTO_FRAMES);
+	printf("      --sparse                  same as --flow lk: track only the arrow grid, for low-power boxes\n");
+	printf("      --stride <n|auto>         analyze every n-th frame, or pick n from the water speed (default 1)\n");
+	printf("      --max-stride <n>          never skip more than this with --stride auto (default %d)\n", STRIDE_MAX);
+	printf("      --max-fps <fps>           with --stride auto, analyze at most this many frames per second of video\n");
+	printf("      --ingest <mode>           decoder: ask the decoder for frames at the analysis size, and gray only when\n");
+	printf("                                no product needs color (GStreamer, camera modes); plain: full frames (default decoder)\n");
+	printf("      --integrator <method>     how the particles and the streamline field move: euler, midpoint or rk4 (default euler)\n");
+	printf("      --substeps <n>            integration steps per frame (default 1)\n");
+	printf("      --interpolate-time        blend from the previous flow field to the current one across the frame\n");
+	printf("      --history <format>        averageVector history storage: float, half or int16 (default half)\n");
+	printf("      --cache-flow <file>       write the flow of every analyzed frame to file, for --replay\n");
+	printf("      --replay <file>           analyze the flow of a --cache-flow file instead of computing it; the video is\n");
+	printf("                                only decoded for the products drawn on the frames, and is optional\n");
+	printf("      --umat                    keep the flow, averages, histogram and colors on UMats, OpenCL when there is one\n");
+	printf("      --no-opencl               run the UMat calls on the CPU even if OpenCL is available\n");
+	printf("      --no-write                encode nothing, same as --encode with an empty list\n");
+	printf("  -H, --headless                no windows and no waitKey, for batch runs and servers\n");
+	printf("  -p, --pipeline                run decode, flow, analysis, render and output as a pipeline of threads\n");
+	printf("  -j, --flow-threads <n>        compute the flow of this many frame pairs at once (implies -p)\n");
+	printf("      --stats-every <n>         also print the stage latencies every n frames\n");
+	printf("  -h, --help                    this message\n");
+}
+
+// list - comma separated product names
+// returns the PRODUCT_ flags, or -1 for an unknown name
+int parse_products(const char* list){
+	int products = 0;
+	std::string names(list);
+	size_t start = 0;
+	while ( start <= names.size() ) {
+		size_t end = names.find(',', start);
+		if ( end == std::string::npos ) end = names.size();
+		std::string name = names.substr(start, end - start);
+
+		if ( name == "streamlines" ) products |= PRODUCT_STREAMLINES;
+		else if ( name == "vector" ) products |= PRODUCT_AVERAGE_VECTOR;
+		else if ( name == "hsv" ) products |= PRODUCT_AVERAGE_HSV;
+		else if ( name == "edges" ) products |= PRODUCT_EDGES;
+		else if ( name == "field" ) products |= PRODUCT_FIELD;
+		else if ( name == "all" ) products |= PRODUCT_ALL;
+		else if ( !name.empty() ) return -1;
+
+		start = end + 1;
+	}
+	return products;
+}
+
 int main(int argc, char** argv )
 {
-	
-	if(argc <2){printf("No video specified\n"); exit(0); }
-	// Turn on OpenCL
-	ocl::setUseOpenCL(true);
-
-	// Set output video name
-	String video_name;
-	if( argc >= 2 ) video_name = argv[2];
-	else video_name = "output";
+	enum { OPT_PRODUCTS = 256, OPT_NO_WRITE, OPT_STATS_EVERY, OPT_HEIGHT, OPT_HISTORY, OPT_AVERAGE, OPT_TIME_CONSTANT, OPT_THRESHOLDS, OPT_THRESHOLD_FRAMES,
+		OPT_PARTICLES, OPT_SEEDING, OPT_RESPAWN, OPT_MAX_AGE, OPT_INTEGRATOR, OPT_SUBSTEPS, OPT_INTERPOLATE_TIME, OPT_SPARSE,
+		OPT_FLOW, OPT_FLOW_PARAMS, OPT_WARM_START, OPT_MASK,
+		OPT_STRIDE, OPT_MAX_STRIDE, OPT_MAX_FPS, OPT_UMAT, OPT_NO_OPENCL, OPT_INGEST,
+		OPT_ENCODE, OPT_ENCODE_POLICY, OPT_ENCODE_QUEUE, OPT_CACHE_FLOW, OPT_REPLAY };
+	static struct option long_options[] = {
+		{"input", required_argument, 0, 'i'},
+		{"output", required_argument, 0, 'o'},
+		{"width", required_argument, 0, 'W'},
+		{"height", required_argument, 0, OPT_HEIGHT},
+		{"products", required_argument, 0, OPT_PRODUCTS},
+		{"encode", required_argument, 0, OPT_ENCODE},
+		{"encode-policy", required_argument, 0, OPT_ENCODE_POLICY},
+		{"encode-queue", required_argument, 0, OPT_ENCODE_QUEUE},
+		{"average", required_argument, 0, OPT_AVERAGE},
+		{"time-constant", required_argument, 0, OPT_TIME_CONSTANT},
+		{"thresholds", required_argument, 0, OPT_THRESHOLDS},
+		{"particles", required_argument, 0, OPT_PARTICLES},
+		{"seeding", required_argument, 0, OPT_SEEDING},
+		{"respawn", required_argument, 0, OPT_RESPAWN},
+		{"max-age", required_argument, 0, OPT_MAX_AGE},
+		{"flow", required_argument, 0, OPT_FLOW},
+		{"flow-params", required_argument, 0, OPT_FLOW_PARAMS},
+		{"warm-start", no_argument, 0, OPT_WARM_START},
+		{"sparse", no_argument, 0, OPT_SPARSE},
+		{"mask", required_argument, 0, OPT_MASK},
+		{"stride", required_argument, 0, OPT_STRIDE},
+		{"max-stride", required_argument, 0, OPT_MAX_STRIDE},
+		{"max-fps", required_argument, 0, OPT_MAX_FPS},
+		{"ingest", required_argument, 0, OPT_INGEST},
+		{"integrator", required_argument, 0, OPT_INTEGRATOR},
+		{"substeps", required_argument, 0, OPT_SUBSTEPS},
+		{"interpolate-time", no_argument, 0, OPT_INTERPOLATE_TIME},
+		{"threshold-frames", required_argument, 0, OPT_THRESHOLD_FRAMES},
+		{"history", required_argument, 0, OPT_HISTORY},
+		{"cache-flow", required_argument, 0, OPT_CACHE_FLOW},
+		{"replay", required_argument, 0, OPT_REPLAY},
+		{"umat", no_argument, 0, OPT_UMAT},
+		{"no-opencl", no_argument, 0, OPT_NO_OPENCL},
+		{"no-write", no_argument, 0, OPT_NO_WRITE},
+		{"headless", no_argument, 0, 'H'},
+		{"pipeline", no_argument, 0, 'p'},
+		{"flow-threads", required_argument, 0, 'j'},
+		{"stats-every", required_argument, 0, OPT_STATS_EVERY},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	String input_name;
+	String video_name = "output";
+	int width = 0;
+	int height = 0;
+	int products = PRODUCT_DEFAULT;
+	int encode = -1;	// same as products
+	int encode_policy = ENCODE_BLOCK;
+	int encode_queue = ENCODE_QUEUE;
+	int history_format = HISTORY_HALF;
+	int average_mode = AVERAGE_BOX;
+	float time_constant = BUFFER_FRAME / 2; // same mean age as the box window
+	int threshold_mode = THRESHOLDS_WINDOW;
+	int threshold_frames = BUFFER_FRAME;
+	int particle_count = DEFAULT_PARTICLES;
+	int seeding = SEED_GRID;
+	int respawn = RESPAWN_NEVER;
+	int max_age = 0;
+	Integrator integrator;
+	bool interpolate_time = false;
+	FlowParams flow;
+	String mask_name;
+	int stride = 1;
+	int max_stride = STRIDE_MAX;
+	float max_fps = 0;
+	int ingest = INGEST_DECODER;
+	String cache_name;
+	String replay_name;
+	bool umat = false;
+	bool opencl = true;
+	bool write = true;
+	bool headless = false;
+	bool pipelined = false;
+	int flow_threads = 1;
+	int opt;
+	while ( (opt = getopt_long(argc, argv, "i:o:W:Hpj:h", long_options, NULL)) != -1 ) {
+		switch ( opt ) {
+			case 'i': input_name = optarg; break;
+			case 'o': video_name = optarg; break;
+			case 'W': width = atoi(optarg); break;
+			case OPT_HEIGHT: height = atoi(optarg); break;
+			case OPT_PRODUCTS:
+				products = parse_products(optarg);
+				if ( products < 0 ) { printf("Unknown product in %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_ENCODE:
+				encode = parse_products(optarg);
+				if ( encode < 0 ) { printf("Unknown product in %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_ENCODE_POLICY:
+				if ( !strcmp(optarg, "block") ) encode_policy = ENCODE_BLOCK;
+				else if ( !strcmp(optarg, "drop") ) encode_policy = ENCODE_DROP;
+				else { printf("Unknown encode policy %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_ENCODE_QUEUE: encode_queue = std::max(atoi(optarg), 1); break;
+			case OPT_AVERAGE:
+				if ( !strcmp(optarg, "box") ) average_mode = AVERAGE_BOX;
+				else if ( !strcmp(optarg, "ema") ) average_mode = AVERAGE_EMA;
+				else { printf("Unknown averaging %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_TIME_CONSTANT: time_constant = atof(optarg); break;
+			case OPT_THRESHOLDS:
+				if ( !strcmp(optarg, "window") ) threshold_mode = THRESHOLDS_WINDOW;
+				else if ( !strcmp(optarg, "decay") ) threshold_mode = THRESHOLDS_DECAY;
+				else { printf("Unknown thresholds mode %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_THRESHOLD_FRAMES: threshold_frames = atoi(optarg); break;
+			case OPT_PARTICLES: particle_count = atoi(optarg); break;
+			case OPT_SEEDING:
+				if ( !strcmp(optarg, "grid") ) seeding = SEED_GRID;
+				else if ( !strcmp(optarg, "random") ) seeding = SEED_RANDOM;
+				else { printf("Unknown seeding %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_RESPAWN:
+				if ( !strcmp(optarg, "never") ) respawn = RESPAWN_NEVER;
+				else if ( !strcmp(optarg, "dead") ) respawn = RESPAWN_DEAD;
+				else { printf("Unknown respawn %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_MAX_AGE: max_age = atoi(optarg); break;
+			case OPT_INTEGRATOR:
+				if ( !strcmp(optarg, "euler") ) integrator.method = INTEGRATE_EULER;
+				else if ( !strcmp(optarg, "midpoint") ) integrator.method = INTEGRATE_MIDPOINT;
+				else if ( !strcmp(optarg, "rk4") ) integrator.method = INTEGRATE_RK4;
+				else { printf("Unknown integrator %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_SUBSTEPS: integrator.substeps = std::max(atoi(optarg), 1); break;
+			case OPT_INTERPOLATE_TIME: interpolate_time = true; break;
+			case OPT_FLOW:
+				if ( !parse_flow_engine(optarg, flow) ) { printf("Unknown flow engine %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_FLOW_PARAMS:
+				if ( !parse_flow_params(optarg, flow) ) { printf("Bad flow parameters %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_WARM_START: flow.warm_start = true; break;
+			case OPT_SPARSE: flow.engine = FLOW_SPARSE_LK; break;
+			case OPT_MASK: mask_name = optarg; break;
+			case OPT_STRIDE:
+				if ( !strcmp(optarg, "auto") ) stride = 0;
+				else if ( (stride = atoi(optarg)) < 1 ) { printf("Bad stride %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_MAX_STRIDE: max_stride = atoi(optarg); break;
+			case OPT_MAX_FPS: max_fps = atof(optarg); break;
+			case OPT_INGEST:
+				if ( !strcmp(optarg, "decoder") ) ingest = INGEST_DECODER;
+				else if ( !strcmp(optarg, "plain") ) ingest = INGEST_PLAIN;
+				else { printf("Unknown ingest %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_HISTORY:
+				if ( !strcmp(optarg, "float") ) history_format = HISTORY_FLOAT;
+				else if ( !strcmp(optarg, "half") ) history_format = HISTORY_HALF;
+				else if ( !strcmp(optarg, "int16") ) history_format = HISTORY_INT16;
+				else { printf("Unknown history format %s\n", optarg); usage(); exit(-1); }
+				break;
+			case OPT_CACHE_FLOW: cache_name = optarg; break;
+			case OPT_REPLAY: replay_name = optarg; break;
+			case OPT_UMAT: umat = true; break;
+			case OPT_NO_OPENCL: opencl = false; break;
+			case OPT_NO_WRITE: write = false; break;
+			case 'H': headless = true; break;
+			case 'p': pipelined = true; break;
+			case 'j': flow_threads = atoi(optarg); pipelined = true; break;
+			case OPT_STATS_EVERY: stage_times.set_report_every(atoi(optarg)); break;
+			case 'h': usage(); exit(0);
+			default: usage(); exit(-1);
+		}
+	}
+
+	if ( flow.warm_start && flow_threads > 1 ) {
+		printf("--warm-start needs the flow in order, it is off with -j %d\n", flow_threads);
+		flow.warm_start = false;
+	}
+
+	// The old positional form still works: ripcurrents <video> [output name]
+	if ( input_name.empty() && optind < argc ) input_name = argv[optind++];
+	if ( optind < argc ) video_name = argv[optind++];
+
+	// A replay has its flow already, the video is only needed for the products drawn on the frames
+	FlowCache replay;
+	bool replaying = !replay_name.empty();
+	int frame_products = PRODUCT_STREAMLINES | PRODUCT_AVERAGE_HSV | PRODUCT_EDGES;
+	if ( replaying ) {
+		if ( !open_flow_cache(replay, replay_name) ) { printf("Could not read flow cache %s\n", replay_name.c_str()); exit(-1); }
+		if ( !cache_name.empty() ) { printf("The flow of a replay is cached already, --cache-flow is ignored\n"); cache_name.clear(); }
+		if ( input_name.empty() && (products & frame_products) ) {
+			printf("Without the video only the average vector and the streamline field are replayed\n");
+			products &= ~frame_products;
+			if ( encode > 0 ) encode &= ~frame_products;
+		}
+		if ( input_name.empty() && mask_name == "auto" ) { printf("--mask auto needs the video\n"); exit(-1); }
+	}
+
+	// The streamline field follows every pixel, the sparse flow only has its grid
+	bool sparse = replaying ? replay.grid > 0 : flow.engine == FLOW_SPARSE_LK;
+	if ( sparse && (products & PRODUCT_FIELD) ) {
+		printf("The streamline field needs the dense flow, it is left out\n");
+		products &= ~PRODUCT_FIELD;
+		if ( encode > 0 ) encode &= ~PRODUCT_FIELD;
+	}
+
+	// Only what is shown or encoded is computed
+	if ( encode < 0 ) encode = products;
+	if ( !write ) encode = 0;
+	int shown = headless ? 0 : products;
+	products = shown | encode;
+
+	if(input_name.empty() && !replaying){printf("No video specified\n"); usage(); exit(0); }
+	// Turn on OpenCL, without it the UMat calls run the CPU code
+	ocl::setUseOpenCL(opencl);
+	if ( umat ) printf("UMat analysis, %s\n", ocl::useOpenCL() ? "OpenCL" : "OpenCL not available, on the CPU");
 	
 	//Video I/O
 	VideoCapture video;
-	if(*argv[1] == (char)'-'){
+	if(input_name.empty()){
+		// replay without the video
+	} else if(input_name == "-"){
 		video = VideoCapture(0);
 		if (!video.isOpened())
 		{
@@ -56,7 +345,7 @@ int main(int argc, char** argv )
 			exit(-1);
 		}
 	} else {
-		video = VideoCapture(argv[1]);
+		video = VideoCapture(input_name);
 		if (!video.isOpened())
 		{
 			std::cout << "!!! Input video could not be opened" << std::endl;
@@ -64,300 +353,109 @@ int main(int argc, char** argv )
 		}
 	}
 	
-	// Set up for output videos
-	
-	VideoWriter video_output( video_name + "0.mp4",CV_FOURCC('X','2','6','4'), 30, cv::Size(XDIM,YDIM),true);
-	VideoWriter video_output1( video_name + "1.mp4",CV_FOURCC('X','2','6','4'), 30, cv::Size(XDIM,YDIM),true);
-	VideoWriter video_output2( video_name + "2.mp4",CV_FOURCC('X','2','6','4'), 30, cv::Size(XDIM,YDIM),true);
-	
-	if (!video_output.isOpened())
-	{
-		std::cout << "!!! Output video could not be opened" << std::endl;
-		exit(-1);
-	}	
-	
-
-	double time_farneback = 0;
-	double time_polar = 0;
-	double time_threshold = 0;
-	double time_overlay = 0;
-	double time_erosion = 0;
-	double time_codec = 0;
-	double time_stream = 0;
-	int frames_read = 0;
-	
-	
-
-//	float scalex = XDIM/video.get(CAP_PROP_FRAME_WIDTH);
-//	float scaley = YDIM/video.get(CAP_PROP_FRAME_HEIGHT);
-	int totalframes = (int) video.get(CAP_PROP_FRAME_COUNT);
-	
-	//A lot of matrices/frames
-	Mat save;
-	Mat frame,f1;
-	Mat subframe;
-	Mat resized;
-	Mat flow_raw;
-	Mat flow;
-	Mat current_prev;
-
-	//OpenCL/GPU matrices
-	UMat u_flow;
-	UMat u_f1,u_f2;
-	
-
-	
-	//Zero out accumulators
-	Mat accumulator = Mat::zeros(Size(XDIM,YDIM), CV_32FC3);
-	
-	Mat out = Mat::zeros(Size(XDIM, YDIM), CV_32FC3);
-	
-	Mat splitarr[2];
-	
-	
-
-	//Some thresholds to mask out any remaining jitter, and strong waves. Don't know how to calculate them at runtime, so they're arbitrary.
-	float LOWER =  0.2;
-	float MID  = .5;
-
-
-	
-	int hist[HIST_BINS] = {0}; //histogram
-	int histsum = 0;
-	float UPPER = 100.0; //UPPER can be determined programmatically
-	
-	int hist2d[HIST_DIRECTIONS][HIST_BINS] = {{0}};
-	int histsum2d[HIST_DIRECTIONS] = {0};
-	float UPPER2d[HIST_DIRECTIONS] = {0};
-	float prop_above_upper[HIST_DIRECTIONS] = {0};
-	
-	
-	
-	
-	sranddev();
-	Mat streamoverlay = Mat::zeros(Size(XDIM, YDIM), CV_8UC1);
-	Mat streamoverlay_color = Mat::zeros(Size(XDIM, YDIM), CV_8UC3);
-
-	//initialize streamline scalar field
-	Mat streamlines_mat = Mat::zeros(YDIM,XDIM,CV_32FC2); //Track displacement from initial point
-	Mat streamlines_distance = Mat::zeros(YDIM,XDIM,CV_32FC1); //Track total distance traveled
-	
-	 //Code for discrete streamline initialization
-	# define MAX_STREAMLINES 500
-	Pixel2 streampt[MAX_STREAMLINES];
-	int streamlines = MAX_STREAMLINES/2;
-
-	/*for(int s = 0; s < streamlines; s++){
-		streampt[s] = Pixel2(rand()%XDIM,rand()%YDIM);
-	}*/
-	for(int x = 0; x < 10; x++){
-		for(int y = 0; y < 10; y++){
-			streampt[x * 10 + y] = Pixel2(XDIM * x / 10, YDIM * y / 10);
+	// Analysis resolution, whichever side is not given follows the aspect ratio of the input
+	double input_width = video.get(CAP_PROP_FRAME_WIDTH);
+	double input_height = video.get(CAP_PROP_FRAME_HEIGHT);
+	if ( replaying && input_name.empty() ) { input_width = replay.size.width; input_height = replay.size.height; }
+	if ( input_width <= 0 || input_height <= 0 ) { input_width = 4; input_height = 3; }
+	if ( width <= 0 && height <= 0 ) width = DEFAULT_XDIM;
+	if ( width <= 0 ) width = (int)round(height * input_width / input_height);
+	if ( height <= 0 ) height = (int)round(width * input_height / input_width);
+	// even sizes keep the encoders happy
+	Size size(std::max(2, width & ~1), std::max(2, height & ~1));
+	// a replay is analyzed at the size of its flow
+	if ( replaying ) size = replay.size;
+	if ( replaying ) printf("Analysis resolution %dx%d, replaying %d frames of flow\n", size.width, size.height, replay.frames);
+	else printf("Analysis resolution %dx%d, %s flow\n", size.width, size.height, flow_engine_name(flow.engine));
+
+	// Where the water is, everything else is left out of the flow and the analysis
+	Mat water;
+	if ( mask_name == "auto" ) {
+		if ( !learn_mask(video, size, MASK_AUTO_FRAMES, water) ) { printf("Video too short to find the water\n"); exit(-1); }
+		if ( water.empty() ) printf("Too little looks like water, analyzing the whole frame\n");
+		else if ( write ) imwrite(video_name + "mask.png", water); // to check it, or to touch up and pass as --mask
+	} else if ( !mask_name.empty() ) {
+		if ( !load_mask(mask_name, Size((int)input_width, (int)input_height), size, water) ) {
+			printf("Could not read mask %s\n", mask_name.c_str());
+			exit(-1);
+		}
+	}
+	if ( !water.empty() ) printf("Water mask covers %.0f%% of the frame\n", 100.0 * countNonZero(water) / size.area());
+
+	// Set up for output videos, each encodes on its own thread
+	Outputs outputs;
+	outputs.shown = shown;
+	outputs.headless = headless;
+	for ( int product = 0; product < PRODUCT_COUNT; product++ ) {
+		if ( !(encode & (1 << product)) ) continue;
+		String name = video_name + std::to_string(product) + ".mp4";
+		if ( !outputs.writers[product].open(name, CV_FOURCC('X','2','6','4'), 30, size, encode_queue, encode_policy) ) {
+			std::cout << "!!! Output video could not be opened" << std::endl;
+			exit(-1);
 		}
 	}
-	namedWindow("streamlines", WINDOW_AUTOSIZE );
-	
-	
-	int framecount; //Generic iterator for main loop.
-	
 	
-	//Preload a frame
-	video.read(frame);
-	if(frame.empty()){exit(1);}
-	resize(frame,subframe,Size(XDIM,YDIM),0,0,INTER_AREA);
-	cvtColor(subframe,f1,COLOR_BGR2GRAY);
-	f1.copyTo(u_f2);
-
-	// stop loop with key
-	int k = -1;
-
-
-	// for average vector
-	std::vector<Mat>buffer;
-	for ( int i = 0; i < BUFFER_FRAME; i++ ) {
-		buffer.push_back(Mat::zeros(YDIM,XDIM,CV_32FC2));
+	int totalframes = input_name.empty() ? replay.source_frames : (int) video.get(CAP_PROP_FRAME_COUNT);
+
+	RipState state;
+	init_state(state, size, sparse, totalframes, products, history_format, average_mode, time_constant,
+		threshold_mode, threshold_frames);
+	init_stride(state.stride, stride, max_stride, max_fps, video.get(CAP_PROP_FPS));
+	state.water = water;
+	grid_mask(water, state.water_grid);
+	init_particles(state.particles, size, particle_count, seeding, respawn, max_age, water);
+	state.integrator = integrator;
+	state.interpolate_time = interpolate_time;
+	if ( umat ) init_umat(state);
+
+	// The flow of every analyzed frame, for --replay later
+	FlowCache cache;
+	if ( !cache_name.empty() ) {
+		if ( !create_flow_cache(cache, cache_name, size, state.sparse ? GRID_COUNT : 0) ) {
+			printf("Could not write flow cache %s\n", cache_name.c_str());
+			exit(-1);
+		}
+		state.cache = &cache;
 	}
-	int update_ith_buffer = 0;
-	Mat average_vector = Mat::zeros(YDIM,XDIM,CV_32FC2);
-	Mat average_vector_color = Mat::zeros(Size(XDIM, YDIM), CV_8UC3);
 
-	float max_displacement = 0.000001;
+	// From here on the frames come at the analysis size, from the decoder where it can
+	VideoSource source;
+	bool color = (products & frame_products) != 0;
+	if ( !input_name.empty() && open_source(source, video, input_name, size, color, ingest) )
+		printf("Decoder delivers %dx%d %s\n", size.width, size.height, source.luma ? "gray" : "frames");
 
-	// create 2d array for grid
-	double ** grid = new double*[GRID_COUNT];
-	for ( int i = 0; i < GRID_COUNT; i++ )
-		grid[i] = new double[GRID_COUNT];
+	RenderState render;
+	init_render(render, size, products);
+	render.umat = umat;
 
-	// for average hsv color
-	std::vector<Mat> buffer_hsv;
-	for ( int i = 0; i < BUFFER_FRAME; i++ ) {
-		buffer_hsv.push_back(Mat::zeros(YDIM,XDIM,CV_8UC3));
-	}
-	Mat average_hsv = Mat::zeros(YDIM, XDIM, CV_8UC3);
+	if ( shown & PRODUCT_STREAMLINES ) namedWindow("streamlines", WINDOW_AUTOSIZE );
 
-	timediff();
-	for( framecount = 1; true; framecount++){
+	if ( replaying ) run_replay(replay, color ? &source : NULL, state, render, outputs);
+	else if ( pipelined ) run_pipelined(source, flow, state, render, outputs, flow_threads);
+	else run_sequential(source, flow, state, render, outputs);
 
-		
+	// the encoders finish their queues first, so their times are in the report
+	for ( int product = 0; product < PRODUCT_COUNT; product++ ) {
+		outputs.writers[product].release();
+		if ( outputs.writers[product].drops() > 0 )
+			printf("Encoder of %s%d.mp4 dropped %ld frames\n", video_name.c_str(), product, outputs.writers[product].drops());
+	}
 
-		video.read(frame);
+	stage_times.report();
 
-		//if ( framecount % 4 == 0 ) continue;
-	
-		printf("Frames read: %d\n",framecount);
-
-
-		
-		if(frame.empty()){break;}
-
-
-		//Resize
-		resize(frame,subframe,Size(XDIM,YDIM),0,0,INTER_LINEAR);
-		cvtColor(subframe,f1,COLOR_BGR2GRAY);
-		
-		//Move to GPU (if possible), compute flow, move back
-		f1.copyTo(u_f1);
-		//Parameters are tweakable
-		calcOpticalFlowFarneback(u_f2,u_f1, u_flow, 0.5, 2, 3, 2, 15, 1.2, OPTFLOW_FARNEBACK_GAUSSIAN); //Give to GPU, possibly
-		flow_raw = u_flow.getMat(ACCESS_READ); //Tell GPU to give it back
-		Mat current = flow_raw;
-
-		/*
-		// stabilize with corner tracking
-		if(framecount > 2) stabilizer(current, current_prev);
-		current.copyTo(current_prev);
-		*/
-		
-
-		
-		
-		// global orientation of entire image
-		/*Mat hist_gray;
-		globalOrientation(u_f1, u_f2, hist_gray);
-		imshow("angle", hist_gray);
-		video_output.write(hist_gray);
-		*/
-		
-
-		u_f1.copyTo(u_f2);
-
-		
-
-		//Simulate the movement of particles in the flow field.
-		streamlines_mat.forEach<Pixel2>([&](Pixel2& pixel, const int position[]) -> void {
-			streamline_field(&pixel, streamlines_distance.ptr<float>(position[0],position[1]), position[1],position[0], current, 2, 1,UPPER,prop_above_upper);
-		});
-
-		// uppdate buffer range 0 <= x < BUFFER_FRAME
-		if ( update_ith_buffer >= BUFFER_FRAME ) update_ith_buffer = 0;
-
-		//average_vector();
-		averageVector(buffer, current, update_ith_buffer, average_vector, average_vector_color, grid, max_displacement, UPPER);
-
-		imshow("average vector", average_vector_color);
-		video_output1.write(average_vector_color);
-
-		// average hsv
-		averageHSV(subframe, buffer_hsv, update_ith_buffer, average_hsv);
-		imshow("average hsv", average_hsv);
-		video_output2.write(average_hsv);
-
-		update_ith_buffer++;
-		
-		Mat streamfield;
-		split(streamlines_mat,splitarr);
-		magnitude(splitarr[0],splitarr[1],streamfield);
-		
-		/*
-		// How far it moved
-		streamline_displacement(streamfield, streamoverlay_color);
-		//imshow("streamline displacement",streamoverlay_color);
-		//video_output.write(streamoverlay_color);
-
-		// How far it has moved
-		streamline_total_motion(streamlines_distance, streamoverlay_color);
-		//imshow("streamline total motion",streamoverlay_color);
-
-		// Ratio of displacement / motion
-		streamline_ratio(streamfield, streamlines_distance, streamoverlay_color);
-		//imshow("streamline displacement/motion ratio",streamoverlay_color);
-		
-		Mat streamline_density = Mat::zeros(Size(XDIM, YDIM), CV_32FC3);
-		streamline_positions(streamlines_mat, streamline_density);
-		//imshow("streamline positions",streamline_density);
-		*/
-		
-		
-		//Discrete,drawable streamlines handled here
-		// creates a copy of current frame
-		Mat streamout;
-		subframe.copyTo(streamout);
-		get_streamlines(streamout, streamoverlay_color, streamoverlay, streamlines, streampt, framecount, totalframes, current, UPPER, prop_above_upper);
-		imshow("streamlines",streamout);
-		video_output.write(streamout);
-
-		
-		
-		//convert the x,y current flow field into angle,magnitude form.
-		//Specifically, angle,magnitude,magnitude, as it is later displayed with HSV
-		//This is more interesting to analyze
-		split(current,splitarr);
-		Mat combine[3];
-		cartToPolar(splitarr[0], splitarr[1], combine[2], combine[0],true);
-		combine[1] = combine[2];
-		merge(combine,3,current);
-
-		//Construct histograms to get thresholds
-		//Figure out what "slow" or "fast" is
-		create_histogram(current,  hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
-		//display_histogram(hist2d,histsum2d,UPPER2d, UPPER,prop_above_upper);
-		
-		
-		
-		Mat accumulator2 = Mat::zeros(Size(XDIM, YDIM), CV_32FC3);
-		Mat waterclass = Mat::zeros(Size(XDIM, YDIM), CV_32FC3);
-
-		//create_flow(current, waterclass, accumulator2, UPPER, MID, LOWER, UPPER2d);
-		//cvtColor(current,current,CV_HSV2BGR);
-		//imshow("flow",current);
-
-		
-		//Mat out = Mat::zeros(Size(XDIM, YDIM), CV_32FC3);
-		//Mat outmask = Mat::zeros(Size(XDIM, YDIM), CV_8UC1);
-
-		//create_accumulationbuffer(accumulator, accumulator2, out, outmask, framecount);
-		//imshow("accumulationbuffer",out);
-
-		
-		//create_edges(outmask);
-		//imshow("edges",outmask);
-
-		
-		//create_output(subframe, outmask);
-		//imshow("output",subframe);
-
-		// end with Esc key on any window
-		int c = waitKey(1);
-		if ( c == 27) break;
-
-		// stop and restart with any key
-		if ( c != -1 && c != 27 ) {
-			waitKey(0);
-		}
-		contin:;
+	if ( !cache_name.empty() ) {
+		printf("Flow of %d frames cached in %s\n", cache.frames, cache_name.c_str());
+		close_flow_cache(cache);
 	}
+	if ( replaying ) close_flow_cache(replay);
 
 	//Clean up
-	flow_raw.release();
+	release_render(render);
 	
-	//waitKey(0);
-	video.release();
-	video_output.release();
-	video_output1.release();
-	video_output2.release();
+	source.video.release();
 
 	// closed all windows
-	destroyAllWindows();
+	if ( !headless ) destroyAllWindows();
 	
 	return 0;
 }
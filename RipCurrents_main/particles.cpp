@@ -0,0 +1,152 @@
+#include <math.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "particles.hpp"
+#include "advection.hpp"
+
+// particles - water mask
+// x, y - a position, off the frame is not water
+static inline bool on_water(const Particles& particles, float x, float y){
+	if ( particles.water.empty() ) return true;
+	if ( !(x >= 0 && y >= 0 && x < particles.water.cols && y < particles.water.rows) ) return false;
+	return particles.water.at<uchar>((int)y, (int)x) != 0;
+}
+
+// particles - to place
+// i - index of the particle
+// rng - for SEED_RANDOM
+// A particle whose spot is on land is seeded dead.
+static void seed_particle(Particles& particles, int i, RNG& rng){
+	if ( particles.seeding == SEED_RANDOM ) {
+		for ( int tries = 0; tries < SEED_TRIES; tries++ ) {
+			particles.x[i] = rng.uniform(1.0f, (float)particles.size.width - 1);
+			particles.y[i] = rng.uniform(1.0f, (float)particles.size.height - 1);
+			if ( on_water(particles, particles.x[i], particles.y[i]) ) break;
+		}
+	} else {
+		// the smallest grid with a spot for everyone, particle i always gets spot i
+		int count = (int)particles.x.size();
+		int cols = (int)ceil(sqrt((double)count * particles.size.width / particles.size.height));
+		int rows = (count + cols - 1) / cols;
+		particles.x[i] = (i % cols + .5f) * particles.size.width / cols;
+		particles.y[i] = (i / cols + .5f) * particles.size.height / rows;
+	}
+	particles.px[i] = particles.x[i];
+	particles.py[i] = particles.y[i];
+	particles.age[i] = 0;
+	particles.alive[i] = on_water(particles, particles.x[i], particles.y[i]);
+	particles.moved[i] = 0;
+}
+
+// particles - to set up
+// size - frame size
+// count - number of particles
+// seeding - SEED_GRID or SEED_RANDOM
+// respawn - RESPAWN_NEVER or RESPAWN_DEAD
+// max_age - frames before a particle is reseeded anyway, 0 for never
+// water - mask of the frame, or empty
+void init_particles(Particles& particles, Size size, int count, int seeding, int respawn, int max_age, Mat water){
+	particles.size = size;
+	particles.water = water;
+	particles.seeding = seeding;
+	particles.respawn = respawn;
+	particles.max_age = max_age;
+	particles.frame = 0;
+
+	count = std::max(count, 0);
+	particles.x.assign(count, 0);
+	particles.y.assign(count, 0);
+	particles.px.assign(count, 0);
+	particles.py.assign(count, 0);
+	particles.age.assign(count, 0);
+	particles.alive.assign(count, 0);
+	particles.moved.assign(count, 0);
+
+	RNG rng(0x5eed);
+	for ( int i = 0; i < count; i++ ) seed_particle(particles, i, rng);
+}
+
+// Advances one block of particles through the frame.
+// start, n - the particles of the block
+// rng - for the respawns
+template <int Method>
+static void advance_block(Particles& particles, int start, int n, const Mat& flow, float dt, float UPPER,
+	const Integrator& integrator, RNG& rng){
+	float ox[SAMPLE_BLOCK], oy[SAMPLE_BLOCK], r[SAMPLE_BLOCK];
+	unsigned char valid[SAMPLE_BLOCK];
+	float* x = &particles.x[start];
+	float* y = &particles.y[start];
+	int substeps = std::max(integrator.substeps, 1);
+	float h = 1.0f / substeps;
+
+	for ( int k = 0; k < n; k++ ) {
+		particles.px[start + k] = x[k];
+		particles.py[start + k] = y[k];
+		particles.moved[start + k] = 0;
+	}
+
+	// dead particles ride along and are ignored, that keeps the block contiguous
+	for ( int i = 0; i < substeps; i++ ) {
+		integrate_step<Method>(flow, integrator.previous, i * h, h, dt, x, y, n, ox, oy, r, valid);
+		for ( int k = 0; k < n; k++ ) {
+			int p = start + k;
+			if ( !particles.alive[p] ) continue;
+			if ( !valid[k] ) particles.alive[p] = 0;
+			else if ( r[k] <= UPPER ) {
+				x[k] += ox[k];
+				y[k] += oy[k];
+				particles.moved[p] = 1;
+				// washed up
+				if ( !on_water(particles, x[k], y[k]) ) particles.alive[p] = 0;
+			}
+		}
+	}
+
+	for ( int k = 0; k < n; k++ ) {
+		int p = start + k;
+		particles.age[p]++;
+		bool expired = particles.max_age > 0 && particles.age[p] > particles.max_age;
+		if ( particles.respawn == RESPAWN_DEAD && (!particles.alive[p] || expired) ) seed_particle(particles, p, rng);
+	}
+}
+
+// particles - advanced in place, blocks of them in parallel
+// flow - CV_32FC2 flow of this frame
+// dt - time step
+// UPPER - a particle in faster flow than this waits for the next sub-step
+// integrator - method, sub-steps and previous flow
+// Particles that leave the frame or the water die, and are reseeded if the policy says so.
+void advance_particles(Particles& particles, Mat flow, float dt, float UPPER, const Integrator& integrator){
+	int count = (int)particles.x.size();
+	unsigned frame = particles.frame++;
+	int blocks = (count + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+
+	parallel_for_(Range(0, blocks), [&](const Range& range) -> void {
+		for ( int block = range.start; block < range.end; block++ ) {
+			// respawns only depend on the frame and the block, not on how the blocks are split
+			// between the threads, so runs are repeatable on any core count
+			RNG rng(((uint64)frame << 32) ^ (uint64)block);
+			int start = block * SAMPLE_BLOCK;
+			int n = std::min(SAMPLE_BLOCK, count - start);
+			if ( integrator.method == INTEGRATE_RK4 )
+				advance_block<INTEGRATE_RK4>(particles, start, n, flow, dt, UPPER, integrator, rng);
+			else if ( integrator.method == INTEGRATE_MIDPOINT )
+				advance_block<INTEGRATE_MIDPOINT>(particles, start, n, flow, dt, UPPER, integrator, rng);
+			else
+				advance_block<INTEGRATE_EULER>(particles, start, n, flow, dt, UPPER, integrator, rng);
+		}
+	});
+}
+
+// particles - after advance_particles()
+// overlay - CV_8UC1, the last step of every particle that moved is drawn on it
+// color - to draw in
+void draw_particles(Particles& particles, Mat overlay, Scalar color){
+	// drawing stays on one thread, cv::line would race on the shared overlay
+	int count = (int)particles.x.size();
+	for ( int i = 0; i < count; i++ ) {
+		if ( !particles.moved[i] ) continue;
+		cv::line(overlay, Pixel2(particles.px[i], particles.py[i]), Pixel2(particles.x[i], particles.y[i]), color, 1, 8, 0);
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef __PARTICLES_HPP_INCLUDE__
+#define __PARTICLES_HPP_INCLUDE__
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "ripcurrents.hpp"
+
+#define DEFAULT_PARTICLES 100 // As many as the old seeded discrete streamlines
+#define SEED_TRIES 16 // random spots tried for a particle before it is left on land
+
+// Where particles start
+#define SEED_GRID 0 // evenly over the frame, a particle always comes back to its own grid spot
+#define SEED_RANDOM 1 // uniformly at random
+
+// What happens to particles that leave the frame or the water
+#define RESPAWN_NEVER 0 // they stay dead, as the old discrete streamlines did
+#define RESPAWN_DEAD 1 // they start again at a new seed
+
+// Discrete streamline particles, one array per field so the advance
+// streams through positions and feeds sample_flow() without gathering.
+struct Particles {
+	Size size;	// frame they live in
+	Mat water;	// water mask, particles are only seeded on water and die on land; empty for the whole frame
+	int seeding;	// SEED_
+	int respawn;	// RESPAWN_
+	int max_age;	// frames before a particle is reseeded anyway, 0 for never
+	unsigned frame;	// advances so far, seeds the random respawns
+
+	std::vector<float> x, y;	// position
+	std::vector<float> px, py;	// position before the last advance, the step that gets drawn
+	std::vector<int> age;	// frames since seeded
+	std::vector<unsigned char> alive;	// 0 once it has left the frame or the water
+	std::vector<unsigned char> moved;	// 1 if the last advance moved it
+};
+
+void init_particles(Particles& particles, Size size, int count, int seeding, int respawn, int max_age, Mat water);
+
+void advance_particles(Particles& particles, Mat flow, float dt, float UPPER, const Integrator& integrator);
+
+void draw_particles(Particles& particles, Mat overlay, Scalar color);
+
+#endif
@@ -0,0 +1,968 @@
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/ocl.hpp>  //Actually opencv3.2, in spite of the name
+
+#include "ripcurrents.hpp"
+#include "pipeline.hpp"
+#include "timing.hpp"
+
+// state - analysis state to zero out
+// size - analysis resolution
+// sparse - the flow comes from compute_sparse_flow(), the average vector is kept on its grid
+// totalframes - frame count of the input, used to color the streamlines
+// products - PRODUCT_ flags of the products to compute
+// history_format - HISTORY_ encoding of the averageVector ring
+// average_mode - AVERAGE_BOX or AVERAGE_EMA
+// time_constant - in frames, for AVERAGE_EMA
+// threshold_mode - THRESHOLDS_WINDOW or THRESHOLDS_DECAY, how the UPPER histograms forget
+// threshold_frames - their window length or time constant
+void init_state(RipState& state, Size size, bool sparse, int totalframes, int products, int history_format, int average_mode, float time_constant,
+	int threshold_mode, int threshold_frames){
+	state.size = size;
+	state.totalframes = totalframes;
+	state.products = products;
+	state.sparse = sparse;
+	init_stride(state.stride, 1, STRIDE_MAX, 0, 30);
+	state.water.release();
+	state.water_grid.release();
+	state.cache = NULL;
+
+	state.histogram.init(threshold_mode, threshold_frames);
+	state.UPPER = 100.0;
+	for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+		state.UPPER2d[angle] = 0;
+		state.prop_above_upper[angle] = 0;
+	}
+
+	//initialize streamline scalar field, forward Euler unless main asks for better
+	state.integrator = Integrator();
+	state.interpolate_time = false;
+	if ( (products & PRODUCT_FIELD) && !sparse ) {
+		state.streamlines_mat = Mat::zeros(size,CV_32FC2);
+		state.streamlines_distance = Mat::zeros(size,CV_32FC1);
+	} else {
+		state.streamlines_mat.release();
+		state.streamlines_distance.release();
+	}
+
+	//Code for discrete streamline initialization, main may set them up differently
+	state.streamoverlay = Mat::zeros(size, CV_8UC1);
+	init_particles(state.particles, size, DEFAULT_PARTICLES, SEED_GRID, RESPAWN_NEVER, 0, Mat());
+	if ( products & PRODUCT_EDGES ) state.accumulator = Mat::zeros(sparse ? Size(GRID_COUNT, GRID_COUNT) : size, CV_32FC3);
+	else state.accumulator.release();
+
+	// for average vector, the rings are only allocated for the products that need them
+	// and the exponential moving average needs none at all; the sparse flow only has the grid to average
+	bool rings = average_mode == AVERAGE_BOX;
+	Size vector_size = sparse ? Size(GRID_COUNT, GRID_COUNT) : size;
+	state.average_mode = average_mode;
+	state.alpha = 1.0 / std::max(time_constant, 1.0f);
+	state.history_format = history_format;
+	state.buffer.clear();
+	for ( int i = 0; i < BUFFER_FRAME && rings && (products & PRODUCT_AVERAGE_VECTOR); i++ ) {
+		state.buffer.push_back(Mat::zeros(vector_size,history_type(history_format)));
+	}
+	state.average_vector = Mat::zeros(vector_size,CV_32FC2);
+
+	// for average hsv color
+	state.buffer_hsv.clear();
+	for ( int i = 0; i < BUFFER_FRAME && rings && (products & PRODUCT_AVERAGE_HSV); i++ ) {
+		state.buffer_hsv.push_back(Mat::zeros(size,CV_8UC3));
+	}
+	if ( rings ) state.sum_hsv = Mat::zeros(size, CV_32FC3);
+	else state.accumulator_hsv = Mat::zeros(size, CV_32FC3);
+	state.average_hsv = Mat::zeros(size, CV_8UC3);
+	state.update_ith_buffer = 0;
+	state.buffer_dt.assign(BUFFER_FRAME, 1);
+	state.buffer_time = BUFFER_FRAME;
+
+	state.umat = false;
+	state.u_water.release();
+	state.u_land.release();
+	state.u_buffer.clear();
+	state.u_buffer_hsv.clear();
+	state.u_accumulator.release();
+}
+
+// state - from init_state(), with its water mask set
+// Switches the analysis to UMats: the flow, the averages, the histogram bins and the color mapping
+// run through the T-API, on the OpenCL device when there is one and on the plain CPU code when not.
+// Only the advection, which samples the flow point by point, maps the flow back to the host.
+void init_umat(RipState& state){
+	state.umat = true;
+	state.water.copyTo(state.u_water);
+	if ( state.water.empty() ) state.u_land.release();
+	else bitwise_not(state.u_water, state.u_land);
+
+	// same rings and averages, the host ones are not used any more;
+	// the grid average of the sparse flow stays on the host, a few hundred vectors are not worth a kernel
+	state.u_buffer.clear();
+	for ( size_t i = 0; i < state.buffer.size() && !state.sparse; i++ )
+		state.u_buffer.push_back(UMat::zeros(state.size, history_type(state.history_format)));
+	if ( !state.sparse ) state.buffer.clear();
+	state.u_buffer_hsv.clear();
+	for ( size_t i = 0; i < state.buffer_hsv.size(); i++ )
+		state.u_buffer_hsv.push_back(UMat::zeros(state.size, CV_8UC3));
+	state.buffer_hsv.clear();
+	if ( !state.sparse ) {
+		state.average_vector.copyTo(state.u_average_vector);
+		state.average_vector.release();
+	}
+	// the edges only need the counts
+	if ( !state.accumulator.empty() && !state.sparse ) {
+		state.u_accumulator = UMat::zeros(state.size, CV_32FC1);
+		state.accumulator.release();
+	}
+	state.sum_hsv.copyTo(state.u_sum_hsv);
+	state.sum_hsv.release();
+	state.accumulator_hsv.copyTo(state.u_accumulator_hsv);
+	state.accumulator_hsv.release();
+	state.average_hsv.copyTo(state.u_average_hsv);
+	state.average_hsv.release();
+}
+
+// render - render state to set up
+// size - analysis resolution
+// products - PRODUCT_ flags of the products to draw
+void init_render(RenderState& render, Size size, int products){
+	render.products = products;
+	render.umat = false;
+	render.streamoverlay_color = Mat::zeros(size, CV_8UC3);
+	render.max_displacement = 0.000001;
+
+	// create 2d array for grid
+	render.grid = new double*[GRID_COUNT];
+	for ( int i = 0; i < GRID_COUNT; i++ )
+		render.grid[i] = new double[GRID_COUNT];
+}
+
+void release_render(RenderState& render){
+	for ( int i = 0; i < GRID_COUNT; i++ )
+		delete[] render.grid[i];
+	delete[] render.grid;
+	render.grid = NULL;
+}
+
+// stride - to set up
+// fixed - stride to keep, 0 to adapt it to the water speed
+// max_stride - adaptive: never more than this
+// max_fps - adaptive: analyzed frames per second of video the cpu can afford, 0 for no limit
+// fps - nominal frame rate of the source
+void init_stride(FrameStride& stride, int fixed, int max_stride, float max_fps, double fps){
+	stride.fixed = std::max(fixed, 0);
+	stride.max_stride = std::max(max_stride, 1);
+	stride.max_fps = std::max(max_fps, 0.0f);
+	stride.fps = fps > 0 ? fps : 30;
+	stride.speed = 0;
+	int budget = stride.max_fps > 0 ? (int)ceil(stride.fps / stride.max_fps) : 1;
+	stride.current = stride.fixed > 0 ? stride.fixed : budget;
+}
+
+// Picks the stride for the next frames: as large as keeps the fast water under STRIDE_TARGET
+// pixels between analyzed frames, so the flow can still follow it, and never so small
+// that more than max_fps frames per second of video get analyzed. The budget wins.
+// It moves one step per frame so a single odd frame does not throw it around.
+// hist - speed histogram of this frame, pixels per source frame
+// pixels - how many were looked at, the ones too fast for the histogram are the difference
+void update_stride(FrameStride& stride, const int hist[HIST_BINS], int pixels){
+	if ( stride.fixed > 0 || pixels <= 0 ) return;
+
+	float speed = (float)HIST_BINS / HIST_RESOLUTION;
+	int rank = (int)(pixels * STRIDE_PERCENTILE);
+	int seen = 0;
+	for ( int bin = 0; bin < HIST_BINS; bin++ ) {
+		seen += hist[bin];
+		if ( seen >= rank ) {
+			speed = (bin + 1.0f) / HIST_RESOLUTION;
+			break;
+		}
+	}
+	stride.speed += (speed - stride.speed) * STRIDE_SMOOTHING;
+
+	int motion = std::min(std::max((int)(STRIDE_TARGET / stride.speed), 1), stride.max_stride);
+	int budget = stride.max_fps > 0 ? (int)ceil(stride.fps / stride.max_fps) : 1;
+	int target = std::max(motion, budget);
+	int current = stride.current;
+	if ( target > current ) stride.current = current + 1;
+	else if ( target < current ) stride.current = current - 1;
+}
+
+// source - input video, see open_source()
+// skip - frames to pass over first, they are grabbed but never retrieved into images
+// data - output: subframe (when a product needs it), gray and time are filled in
+// returns false at the end of the video
+bool decode_frame(VideoSource& source, int skip, FrameData& data){
+	Mat frame;
+	{
+		ScopedTimer timer(STAGE_DECODE);
+		for ( int i = 0; i < skip; i++ ) {
+			if ( !source.video.grab() ) return false;
+		}
+		source.video.read(frame);
+		data.time = source.video.get(CAP_PROP_POS_MSEC) / 1000;
+	}
+	if(frame.empty()){return false;}
+
+	//Resize, unless the decoder already did
+	ScopedTimer timer(STAGE_RESIZE);
+	convert_frame(source, frame, data.subframe, data.gray);
+	return true;
+}
+
+// Decodes the frame stride.current source frames after the last one, the very first frame is read as is.
+// last_time - timestamp of the last frame, < 0 before the first; updated
+// data - input: framecount, source_frame of the last frame; output: as decode_frame() plus source_frame and dt
+// returns false at the end of the video
+bool decode_stride(VideoSource& source, FrameStride& stride, double& last_time, FrameData& data){
+	int step = data.framecount == 0 ? 1 : stride.current.load();
+	if ( !decode_frame(source, step - 1, data) ) return false;
+	data.source_frame += step;
+
+	// the real time between the frames, in source frames; timestamps far from the frame count
+	// (none at all, a camera clock that jumps) are not trusted, and ones close to it are only
+	// rounding (millisecond timestamps at 30 fps), so the fields are not all rescaled for nothing
+	data.dt = step;
+	if ( last_time >= 0 && data.time > last_time ) {
+		float dt = (data.time - last_time) * stride.fps;
+		if ( dt > step * .25f && dt < step * 4.0f && fabs(dt - step) > STRIDE_DT_SNAP ) data.dt = dt;
+	}
+	last_time = data.time;
+	return true;
+}
+
+// flowstate - to set up for one flow thread
+// params - backend and its parameters
+// size - analysis resolution
+// water - mask, the flow is only computed around it; empty for the whole frame
+// umat - hand the flow on as a UMat, for the UMat mode of the analysis
+void init_flow(FlowState& flowstate, const FlowParams& params, Size size, const Mat& water, bool umat){
+	flowstate.sparse = params.engine == FLOW_SPARSE_LK;
+	flowstate.umat = umat;
+	flowstate.engine = create_flow_engine(params, false, Ptr<DenseOpticalFlow>());
+	flowstate.warm_start = params.warm_start;
+	// the cold refreshes and the warm frames in between pass the last frame's expansion on
+	flowstate.warm = params.warm_start ? create_flow_engine(params, true, flowstate.engine) : Ptr<DenseOpticalFlow>();
+	flowstate.warm_refresh = params.warm_refresh;
+	flowstate.warm_frames = 0;
+	flowstate.last_dt = 0;
+	flowstate.roi = mask_bounds(water, size);
+	if ( water.empty() ) flowstate.land.release();
+	else bitwise_not(water, flowstate.land);
+	if ( umat ) flowstate.land.copyTo(flowstate.u_land);
+	grid_mask(water, flowstate.water_grid);
+}
+
+// flowstate - roi and land
+// u_flow - flow of the roi
+// flow - output: CV_32FC2 the size of the frame, 0 off the water
+static void place_flow(const FlowState& flowstate, const UMat& u_flow, Size size, Mat& flow){
+	if ( flowstate.roi.size() == size ) {
+		u_flow.copyTo(flow);
+	} else {
+		flow = Mat::zeros(size, CV_32FC2);
+		Mat inside = flow(flowstate.roi);
+		u_flow.copyTo(inside);
+	}
+	if ( !flowstate.land.empty() ) flow.setTo(Scalar::all(0), flowstate.land);
+}
+
+// The same into a UMat, for the UMat mode, the flow never comes back to the host
+static void place_flow(const FlowState& flowstate, const UMat& u_flow, Size size, UMat& flow){
+	if ( flowstate.roi.size() == size ) {
+		u_flow.copyTo(flow);
+	} else {
+		flow = UMat::zeros(size, CV_32FC2);
+		UMat inside = flow(flowstate.roi);
+		u_flow.copyTo(inside);
+	}
+	if ( !flowstate.u_land.empty() ) flow.setTo(Scalar::all(0), flowstate.u_land);
+	// the analysis picks it up on another thread, with another OpenCL queue
+	ocl::finish();
+}
+
+// flowstate - with a warm start, whether this field starts from the last one
+// Counts the warm starts, so every warm_refresh frames there is a cold one.
+static bool start_warm(FlowState& flowstate){
+	bool warm = flowstate.warm_start && flowstate.last_dt > 0
+		&& (flowstate.warm_refresh <= 0 || flowstate.warm_frames < flowstate.warm_refresh);
+	flowstate.warm_frames = warm ? flowstate.warm_frames + 1 : 0;
+	return warm;
+}
+
+// flowstate - keeps the previous frame, and the previous field for a warm start
+// data - input: gray and dt, output: flow, or u_flow in the UMat mode
+// returns false for the very first frame, which only primes the previous frame
+bool compute_flow(FlowState& flowstate, FrameData& data){
+	if ( flowstate.sparse ) {
+		if ( flowstate.prev_gray.empty() ) {
+			data.gray.copyTo(flowstate.prev_gray);
+			return false;
+		}
+		ScopedTimer timer(STAGE_FLOW);
+		// the last field, scaled to this frame's dt for a change of stride
+		Mat initial;
+		if ( start_warm(flowstate) ) initial = flowstate.prev_grid_flow * (data.dt / flowstate.last_dt);
+		Mat found;
+		compute_sparse_flow(flowstate.prev_gray, data.gray, flowstate.water_grid, initial, flowstate.prev_grid_found, data.grid_flow, found);
+		data.gray.copyTo(flowstate.prev_gray);
+		// the analysis rescales grid_flow in place, on another thread
+		if ( flowstate.warm_start ) {
+			flowstate.prev_grid_flow = data.grid_flow.clone();
+			flowstate.prev_grid_found = found;
+		}
+		flowstate.last_dt = data.dt;
+		return true;
+	}
+
+	//Move to GPU (if possible), compute flow, move back
+	//Only the part around the water
+	data.gray(flowstate.roi).copyTo(flowstate.u_f1);
+	if ( flowstate.u_f2.empty() ) {
+		flowstate.u_f1.copyTo(flowstate.u_f2);
+		return false;
+	}
+
+	{
+		ScopedTimer timer(STAGE_FLOW);
+		//Backend and parameters come from init_flow()
+		if ( start_warm(flowstate) ) {
+			// the last field is the start, scaled to this frame's dt for a change of stride
+			if ( data.dt != flowstate.last_dt ) flowstate.u_flow.convertTo(flowstate.u_flow, -1, data.dt / flowstate.last_dt);
+			flowstate.warm->calc(flowstate.u_f2,flowstate.u_f1, flowstate.u_flow); //Give to GPU, possibly
+		} else {
+			// DIS would take what is left in u_flow as its start
+			flowstate.u_flow.release();
+			flowstate.engine->calc(flowstate.u_f2,flowstate.u_f1, flowstate.u_flow); //Give to GPU, possibly
+		}
+		flowstate.last_dt = data.dt;
+		if ( flowstate.umat ) place_flow(flowstate, flowstate.u_flow, data.gray.size(), data.u_flow);
+		else place_flow(flowstate, flowstate.u_flow, data.gray.size(), data.flow); //Tell GPU to give it back
+	}
+
+	/*
+	// stabilize with corner tracking
+	if(framecount > 2) stabilizer(current, current_prev);
+	current.copyTo(current_prev);
+	*/
+
+	// global orientation of entire image
+	/*Mat hist_gray;
+	globalOrientation(u_f1, u_f2, hist_gray);
+	imshow("angle", hist_gray);
+	video_output.write(hist_gray);
+	*/
+
+	flowstate.u_f1.copyTo(flowstate.u_f2);
+	return true;
+}
+
+// flowstate - engine of this thread, the previous frame is not used
+// data - input: prev_gray and gray, output: flow, or u_flow in the UMat mode
+// Keeps no frames, so any number of frame pairs can be computed at once, one flowstate each.
+// Which also means no warm start, the last field is not known yet.
+void compute_flow_pair(FlowState& flowstate, FrameData& data){
+	ScopedTimer timer(STAGE_FLOW);
+	if ( flowstate.sparse ) {
+		Mat found;
+		compute_sparse_flow(data.prev_gray, data.gray, flowstate.water_grid, Mat(), Mat(), data.grid_flow, found);
+		data.prev_gray.release();
+		return;
+	}
+	UMat u_f1, u_f2, u_flow;
+	data.prev_gray(flowstate.roi).copyTo(u_f2);
+	data.gray(flowstate.roi).copyTo(u_f1);
+	flowstate.engine->calc(u_f2,u_f1, u_flow);
+	if ( flowstate.umat ) place_flow(flowstate, u_flow, data.gray.size(), data.u_flow);
+	else place_flow(flowstate, u_flow, data.gray.size(), data.flow);
+	data.prev_gray.release();
+}
+
+// points - grid points to track with LK, from prev_gray to gray
+// cells - index of the grid cell of each point
+// tracked - where to start looking for each point, on levels below FLOW_LK_LEVELS; empty for a cold start
+// grid_flow, found - the vectors of the points LK tracked go to their cells, and 255 to found
+static void track_cells(const Mat& prev_gray, const Mat& gray, const std::vector<Point2f>& points, const std::vector<int>& cells,
+	std::vector<Point2f>& tracked, int levels, Mat& grid_flow, Mat& found){
+	if ( points.empty() ) return;
+	std::vector<uchar> status;
+	std::vector<float> err;
+	int flags = tracked.empty() ? 0 : OPTFLOW_USE_INITIAL_FLOW;
+	calcOpticalFlowPyrLK(prev_gray, gray, points, tracked, status, err, Size(21,21), levels,
+		TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), flags);
+
+	Pixel2* cell = grid_flow.ptr<Pixel2>(0);
+	uchar* hit = found.ptr<uchar>(0);
+	for ( size_t i = 0; i < points.size(); i++ ) {
+		if ( !status[i] ) continue;
+		cell[cells[i]] = tracked[i] - points[i];
+		hit[cells[i]] = 255;
+	}
+}
+
+// Sparse flow for deployments that only need the arrows, the particles and the thresholds.
+// Pyramidal LK tracks the centers of the GRID_COUNT x GRID_COUNT cells, a few hundred points
+// instead of every pixel. The analysis averages and bins those, and only interpolates a dense
+// field from them for what samples it per pixel, see sparse_dense_flow().
+// prev_gray, gray - consecutive frames
+// water_grid - CV_8UC1 GRID_COUNT x GRID_COUNT, only the points on water are tracked; empty for all
+// initial - CV_32FC2 GRID_COUNT x GRID_COUNT where to start looking, tracked on fewer levels; empty for a cold start
+// initial_found - CV_8UC1 GRID_COUNT x GRID_COUNT, the found of the field initial came from: a cell LK lost there
+// has no guess in initial, only a zero, and is tracked cold on all the levels instead; empty if all were found
+// grid_flow - output: CV_32FC2 GRID_COUNT x GRID_COUNT, 0 where LK lost the point or did not track it
+// found - output: CV_8UC1 GRID_COUNT x GRID_COUNT, 255 where LK tracked the point
+void compute_sparse_flow(const Mat& prev_gray, const Mat& gray, const Mat& water_grid, const Mat& initial, const Mat& initial_found, Mat& grid_flow, Mat& found){
+	std::vector<Point2f> points, warm_points, tracked;
+	std::vector<int> cells, warm_cells;
+	for ( int row = 0; row < GRID_COUNT; row++ ) {
+		for ( int col = 0; col < GRID_COUNT; col++ ) {
+			if ( !water_grid.empty() && !water_grid.at<uchar>(row, col) ) continue;
+			Point2f point((col + .5f) * gray.cols / GRID_COUNT, (row + .5f) * gray.rows / GRID_COUNT);
+			if ( !initial.empty() && (initial_found.empty() || initial_found.at<uchar>(row, col)) ) {
+				warm_points.push_back(point);
+				warm_cells.push_back(row * GRID_COUNT + col);
+				tracked.push_back(point + initial.at<Pixel2>(row, col));
+			} else {
+				points.push_back(point);
+				cells.push_back(row * GRID_COUNT + col);
+			}
+		}
+	}
+
+	grid_flow = Mat::zeros(GRID_COUNT, GRID_COUNT, CV_32FC2);
+	found = Mat::zeros(GRID_COUNT, GRID_COUNT, CV_8UC1);
+	std::vector<Point2f> cold;
+	track_cells(prev_gray, gray, points, cells, cold, FLOW_LK_LEVELS, grid_flow, found);
+	track_cells(prev_gray, gray, warm_points, warm_cells, tracked, FLOW_LK_WARM_LEVELS, grid_flow, found);
+}
+
+// Sparse mode: data.flow, the dense field interpolated from data.grid_flow, zero off the water.
+// The cell centers land on the same spots of the full size field.
+static void sparse_dense_flow(const RipState& state, FrameData& data){
+	if ( !data.flow.empty() ) return;
+	Mat dense;
+	resize(data.grid_flow, dense, state.size, 0, 0, INTER_LINEAR);
+	if ( state.water.empty() ) data.flow = dense;
+	else {
+		data.flow = Mat::zeros(state.size, CV_32FC2);
+		dense.copyTo(data.flow, state.water);
+	}
+}
+
+// state - the edge accumulator
+// data - output: outmask, the water the edges go around
+// accumulator2 - CV_32FC3 the pixels (the grid cells in sparse mode) create_histogram_flow() found faster than UPPER
+// fast - UMat mode: the same from create_histogram_umat()
+// The wave accumulation of the original program: every pixel faster than UPPER is counted, and
+// create_accumulationbuffer() marks what was fast in few of the frames. create_edges() finishes it.
+static void accumulate_edges(RipState& state, FrameData& data, const Mat& accumulator2, const UMat& fast){
+	if ( state.umat && !state.sparse ) {
+		// create_accumulationbuffer() on the counts alone, only the finished mask comes back
+		if ( data.framecount > 30 ) add(state.u_accumulator, Scalar::all(1), state.u_accumulator, fast);
+		UMat mask;
+		compare(state.u_accumulator, Scalar::all(.1 * data.framecount), mask, CMP_LE);
+		if ( !state.u_water.empty() ) bitwise_and(mask, state.u_water, mask);
+		mask.copyTo(data.outmask);
+		return;
+	}
+
+	Mat out = Mat::zeros(accumulator2.size(), CV_32FC3);	// its own picture of the classes, not a product
+	Mat outmask = Mat::zeros(accumulator2.size(), CV_8UC1);
+	create_accumulationbuffer(state.accumulator, accumulator2, out, outmask, data.framecount);
+	// land is never fast, but it is not water either
+	const Mat& water = state.sparse ? state.water_grid : state.water;
+	if ( !water.empty() ) bitwise_and(outmask, water, outmask);
+	// the cells of the sparse flow cover the frame
+	if ( state.sparse ) resize(outmask, data.outmask, state.size, 0, 0, INTER_NEAREST);
+	else data.outmask = outmask;
+}
+
+// Writes the flow of a frame to state.cache, as the flow stage left it.
+// A cache that can not be written is given up on, the analysis goes on.
+static void cache_flow(RipState& state, const FrameData& data){
+	FlowCacheRecord record;
+	record.framecount = data.framecount;
+	record.source_frame = data.source_frame;
+	record.time = data.time;
+	record.dt = data.dt;
+	record.reserved = 0;
+	// the sparse flow only keeps its grid
+	Mat flow;
+	if ( !state.sparse ) flow = state.umat ? data.u_flow.getMat(ACCESS_READ) : data.flow;
+	if ( !write_flow_cache(*state.cache, record, flow, data.grid_flow) ) {
+		printf("Could not write the flow cache, no more frames go to it\n");
+		state.cache = NULL;
+	}
+}
+
+// state - everything that needs the frames in order
+// data - input: subframe and flow (u_flow in the UMat mode), output: snapshots for the render stage
+void analyze_frame(RipState& state, FrameData& data){
+	if ( state.cache ) cache_flow(state, data);
+
+	// Everything from here on is in pixels per source frame, whatever the stride,
+	// so the thresholds and averages mean the same; the integrators step over the real time.
+	// Into new Mats, the flow may be a read only replay record, see run_replay().
+	// Sparse mode has no dense field yet, it is interpolated from the rescaled grid.
+	if ( data.dt != 1 ) {
+		if ( state.sparse ) {
+			Mat scaled;
+			data.grid_flow.convertTo(scaled, -1, 1.0 / data.dt);
+			data.grid_flow = scaled;
+		} else if ( state.umat ) data.u_flow.convertTo(data.u_flow, -1, 1.0 / data.dt);
+		else {
+			Mat scaled;
+			data.flow.convertTo(scaled, -1, 1.0 / data.dt);
+			data.flow = scaled;
+		}
+	}
+	float dt = 2 * data.dt;
+
+	//The points go wherever the flow takes them, the one place the UMat mode maps the flow,
+	//and only for the length of this block
+	bool field = (state.products & PRODUCT_FIELD) && !state.sparse;
+	if ( field || (state.products & PRODUCT_STREAMLINES) ) {
+		ScopedTimer timer(STAGE_ADVECTION);
+		//The sparse flow only gets a dense field for the particles
+		Mat current;
+		if ( state.sparse ) {
+			sparse_dense_flow(state, data);
+			current = data.flow;
+		} else current = state.umat ? data.u_flow.getMat(ACCESS_READ) : data.flow;
+
+		//Simulate the movement of particles in the flow field.
+		//Not in sparse mode, interpolated grid vectors say nothing per pixel
+		if ( field )
+			streamline_field_rows(state.streamlines_mat, state.streamlines_distance, current, dt, state.UPPER, state.integrator, state.water);
+
+		//Discrete,drawable streamlines handled here
+		if ( state.products & PRODUCT_STREAMLINES ) {
+			advance_particles(state.particles, current, dt, state.UPPER, state.integrator);
+			draw_particles(state.particles, state.streamoverlay, Scalar(data.source_frame*(255.0/state.totalframes)));
+		}
+
+		// the next frame integrates from this field to its own
+		if ( state.interpolate_time ) state.integrator.previous = state.umat ? current.clone() : current;
+	}
+
+	// uppdate buffer range 0 <= x < BUFFER_FRAME
+	if ( state.update_ith_buffer >= BUFFER_FRAME ) state.update_ith_buffer = 0;
+
+	// the EMA forgets by time, not by frames, and the box averages weigh the frames by it
+	float alpha = 1 - pow(1 - state.alpha, data.dt);
+	BoxWeights weights;
+	weights.in = data.dt;
+	weights.out = state.buffer_dt[state.update_ith_buffer];
+	weights.total = state.buffer_time - weights.out + weights.in;
+
+	//average_vector();
+	if ( state.products & PRODUCT_AVERAGE_VECTOR ) {
+		ScopedTimer timer(STAGE_AVERAGE_VECTOR);
+		if ( state.sparse ) {
+			if ( state.average_mode == AVERAGE_EMA )
+				averageVectorGridEMA(data.grid_flow, state.average_vector, alpha, state.UPPER, state.water_grid);
+			else
+				averageVectorGrid(state.buffer, state.history_format, data.grid_flow, state.update_ith_buffer, state.average_vector, state.UPPER, state.water_grid, weights);
+		} else if ( state.umat ) {
+			if ( state.average_mode == AVERAGE_EMA )
+				averageVectorEMA(data.u_flow, state.u_average_vector, alpha, state.UPPER, state.u_water, state.u_delta);
+			else
+				averageVector(state.u_buffer, state.history_format, data.u_flow, state.update_ith_buffer, state.u_average_vector, state.UPPER, state.u_water, weights);
+		} else if ( state.average_mode == AVERAGE_EMA )
+			averageVectorEMA(data.flow, state.average_vector, alpha, state.UPPER, state.water);
+		else
+			averageVector(state.buffer, state.history_format, data.flow, state.update_ith_buffer, state.average_vector, state.UPPER, state.water, weights);
+	}
+
+	// average hsv
+	if ( state.products & PRODUCT_AVERAGE_HSV ) {
+		ScopedTimer timer(STAGE_AVERAGE_HSV);
+		if ( state.umat ) {
+			UMat subframe;
+			data.subframe.copyTo(subframe);
+			if ( state.average_mode == AVERAGE_EMA )
+				averageHSVEMA(subframe, state.u_accumulator_hsv, state.u_average_hsv, alpha);
+			else
+				averageHSV(subframe, state.u_buffer_hsv, state.update_ith_buffer, state.u_sum_hsv, state.u_average_hsv, weights);
+		} else if ( state.average_mode == AVERAGE_EMA )
+			averageHSVEMA(data.subframe, state.accumulator_hsv, state.average_hsv, alpha);
+		else
+			averageHSV(data.subframe, state.buffer_hsv, state.update_ith_buffer, state.sum_hsv, state.average_hsv, weights);
+	}
+
+	state.buffer_dt[state.update_ith_buffer] = weights.in;
+	state.buffer_time = weights.total;
+	state.update_ith_buffer++;
+
+	/*
+	Mat streamfield;
+	Mat splitarr[2];
+	split(state.streamlines_mat,splitarr);
+	magnitude(splitarr[0],splitarr[1],streamfield);
+
+	// How far it moved, see the field product
+
+	// How far it has moved
+	streamline_total_motion(state.streamlines_distance, streamoverlay_color);
+	//imshow("streamline total motion",streamoverlay_color);
+
+	// Ratio of displacement / motion
+	streamline_ratio(streamfield, state.streamlines_distance, streamoverlay_color);
+	//imshow("streamline displacement/motion ratio",streamoverlay_color);
+
+	Mat streamline_density = Mat::zeros(state.size, CV_32FC3);
+	streamline_positions(state.streamlines_mat, streamline_density);
+	//imshow("streamline positions",streamline_density);
+	*/
+
+	{
+		ScopedTimer timer(STAGE_HISTOGRAM);
+		//Construct histograms to get thresholds, straight from the x,y flow
+		//Figure out what "slow" or "fast" is
+		//The edges classify in the same pass, against the thresholds of the last frame
+		int hist[HIST_BINS] = {0};
+		int histsum = 0;
+		int hist2d[HIST_DIRECTIONS][HIST_BINS] = {{0}};
+		int histsum2d[HIST_DIRECTIONS] = {0};
+		//Sparse mode counts the tracked vectors themselves, not the interpolation between them
+		//Only water counts, the still land would pile up in the slowest bins
+		//The UMat mode bins on the UMat and only counts on the host
+		bool edges = (state.products & PRODUCT_EDGES) != 0;
+		Mat accumulator2;
+		UMat fast;
+		if ( state.umat && !state.sparse ) {
+			if ( edges ) fast.create(state.size, CV_8UC1);
+			create_histogram_umat(data.u_flow, hist, histsum, hist2d, histsum2d, state.u_land, state.UPPER, fast);
+		} else {
+			const Mat& flow = state.sparse ? data.grid_flow : data.flow;
+			if ( edges ) accumulator2 = Mat::zeros(flow.size(), CV_32FC3);
+			create_histogram_flow(flow, hist, histsum, hist2d, histsum2d,
+				state.UPPER, 0, 0, state.UPPER2d, Mat(), accumulator2, Mat(), state.sparse ? state.water_grid : state.water);
+		}
+		//display_histogram(hist2d,histsum2d,state.UPPER2d, state.UPPER,state.prop_above_upper);
+
+		// thresholds from the recent frames only, this frame's counts replace the oldest
+		state.histogram.add_frame(hist2d, data.dt);
+		state.histogram.thresholds(state.UPPER, state.UPPER2d, state.prop_above_upper);
+
+		// and the stride for the next frames from how fast the water is now
+		const Mat& counted = state.sparse ? state.water_grid : state.water;
+		int pixels = !counted.empty() ? countNonZero(counted) : state.sparse ? GRID_COUNT * GRID_COUNT : state.size.area();
+		update_stride(state.stride, hist, pixels);
+
+		if ( edges ) accumulate_edges(state, data, accumulator2, fast);
+	}
+
+	// Hand copies to the render stage, the running state keeps changing;
+	// the grid average of the sparse flow at full size, as the arrows are drawn
+	if ( state.sparse && (state.products & PRODUCT_AVERAGE_VECTOR) ) {
+		resize(state.average_vector, data.average_vector, state.size, 0, 0, INTER_LINEAR);
+		if ( state.umat ) data.average_vector.copyTo(data.u_average_vector);
+	}
+	if ( state.umat ) {
+		if ( !state.sparse && (state.products & PRODUCT_AVERAGE_VECTOR) ) state.u_average_vector.copyTo(data.u_average_vector);
+		if ( state.products & PRODUCT_AVERAGE_HSV ) state.u_average_hsv.copyTo(data.u_average_hsv);
+		// the render stage picks them up on another thread, with another OpenCL queue
+		ocl::finish();
+	} else {
+		if ( !state.sparse && (state.products & PRODUCT_AVERAGE_VECTOR) ) state.average_vector.copyTo(data.average_vector);
+		if ( state.products & PRODUCT_AVERAGE_HSV ) state.average_hsv.copyTo(data.average_hsv);
+	}
+	if ( state.products & PRODUCT_STREAMLINES ) state.streamoverlay.copyTo(data.streamoverlay);
+	if ( field ) state.streamlines_mat.copyTo(data.streamfield);
+}
+
+// render - scratch space for drawing
+// data - input: analysis snapshots, output: streamout, average_vector_color, edges and field
+void render_frame(RenderState& render, FrameData& data){
+	ScopedTimer timer(STAGE_RENDER);
+	if ( render.products & PRODUCT_AVERAGE_VECTOR ) {
+		if ( render.umat ) {
+			draw_average_vector(data.u_average_vector, data.average_vector_color, render.grid, render.max_displacement);
+		} else {
+			data.average_vector_color.create(data.average_vector.size(), CV_8UC3);
+			draw_average_vector(data.average_vector, data.average_vector_color, render.grid, render.max_displacement);
+		}
+	}
+
+	// the writers and windows take host images
+	if ( render.umat && (render.products & PRODUCT_AVERAGE_HSV) ) data.u_average_hsv.copyTo(data.average_hsv);
+
+	if ( render.products & PRODUCT_STREAMLINES ) {
+		// creates a copy of current frame
+		data.subframe.copyTo(data.streamout);
+		draw_streamlines(data.streamout, render.streamoverlay_color, data.streamoverlay);
+	}
+
+	if ( render.products & PRODUCT_EDGES ) {
+		create_edges(data.outmask);
+		data.subframe.copyTo(data.edges);
+		create_output(data.edges, data.outmask);
+	}
+
+	if ( (render.products & PRODUCT_FIELD) && !data.streamfield.empty() ) {
+		// How far it moved
+		Mat streamfield;
+		Mat splitarr[2];
+		split(data.streamfield,splitarr);
+		magnitude(splitarr[0],splitarr[1],streamfield);
+		streamline_displacement(streamfield, data.field);
+	}
+}
+
+// name, fourcc, fps, size - as for VideoWriter::open(), always color
+// capacity - frames that may wait for the encoder
+// policy - ENCODE_BLOCK or ENCODE_DROP, what write() does while that many wait
+// returns false if the writer could not be opened
+bool AsyncWriter::open(const String& name, int fourcc, double fps, Size size, size_t capacity, int policy){
+	release();
+	if ( !writer.open(name, fourcc, fps, size, true) ) return false;
+	this->policy = policy;
+	dropped = 0;
+	queue = makePtr<BoundedQueue<Mat> >(std::max(capacity, (size_t)1));
+	thread = std::thread(&AsyncWriter::run, this);
+	opened = true;
+	return true;
+}
+
+// frame - handed over as it is, nothing may change it afterwards
+void AsyncWriter::write(const Mat& frame){
+	if ( !opened ) return;
+	if ( policy == ENCODE_DROP ) {
+		if ( !queue->try_push(frame) ) dropped++;
+	} else {
+		queue->push(frame);
+	}
+}
+
+// Encodes whatever is still queued and closes the file.
+void AsyncWriter::release(){
+	if ( !opened ) return;
+	queue->close();
+	thread.join();
+	writer.release();
+	queue = Ptr<BoundedQueue<Mat> >();
+	opened = false;
+}
+
+void AsyncWriter::run(){
+	Mat frame;
+	while ( queue->pop(frame) ) {
+		ScopedTimer timer(STAGE_ENCODE);
+		writer.write(frame);
+	}
+}
+
+// data - rendered frame
+// product - index of a product, PRODUCT_ flag 1 << product
+static const Mat& product_image(const FrameData& data, int product){
+	switch ( 1 << product ) {
+		case PRODUCT_AVERAGE_VECTOR: return data.average_vector_color;
+		case PRODUCT_AVERAGE_HSV: return data.average_hsv;
+		case PRODUCT_EDGES: return data.edges;
+		case PRODUCT_FIELD: return data.field;
+		default: return data.streamout;
+	}
+}
+
+static const char* product_windows[PRODUCT_COUNT] = { "streamlines", "average vector", "average hsv", "edges", "streamline field" };
+
+// outputs - writers for the products
+// data - rendered frame
+// returns false when the user asked to stop
+bool output_frame(Outputs& outputs, FrameData& data){
+	// the encoder threads get the images themselves, every frame renders into new ones
+	for ( int product = 0; product < PRODUCT_COUNT; product++ ) {
+		if ( outputs.writers[product].isOpened() ) outputs.writers[product].write(product_image(data, product));
+	}
+	stage_times.end_frame();
+
+	if ( !outputs.headless ) {
+		for ( int product = 0; product < PRODUCT_COUNT; product++ ) {
+			if ( outputs.shown & (1 << product) ) imshow(product_windows[product], product_image(data, product));
+		}
+	}
+
+	// Nothing to wait for without windows, run flat out
+	if ( outputs.headless ) return true;
+
+	// end with Esc key on any window
+	int c = waitKey(1);
+	if ( c == 27) return false;
+
+	// stop and restart with any key
+	if ( c != -1 && c != 27 ) {
+		waitKey(0);
+	}
+	return true;
+}
+
+// Runs every stage for one frame before reading the next.
+// flow - backend of the flow stage
+void run_sequential(VideoSource& source, const FlowParams& flow, RipState& state, RenderState& render, Outputs& outputs){
+	FlowState flowstate;
+	init_flow(flowstate, flow, state.size, state.water, state.umat);
+
+	double last_time = -1;
+	int source_frame = -1;
+	for( int framecount = 0; true; framecount++){
+		FrameData data;
+		data.framecount = framecount;
+		data.source_frame = source_frame;
+
+		if ( !decode_stride(source, state.stride, last_time, data) ) break;
+		source_frame = data.source_frame;
+		if ( framecount > 0 ) printf("Frames read: %d\n",framecount);
+
+		if ( !compute_flow(flowstate, data) ) continue;
+		analyze_frame(state, data);
+		render_frame(render, data);
+		if ( !output_frame(outputs, data) ) break;
+	}
+}
+
+// Runs decode, flow, analysis and render on their own threads, joined by BoundedQueues.
+// Output stays on the calling thread, highgui does not like other threads.
+// Each frame moves through the stages in order, so the frame rate is that of the slowest stage.
+// flow_threads - with more than one, the flow of that many frame pairs is computed at once
+// and a ReorderBuffer hands the fields to the analysis in frame order.
+// flow - backend of the flow stage, every flow thread gets its own engine
+void run_pipelined(VideoSource& source, const FlowParams& flow, RipState& state, RenderState& render, Outputs& outputs, int flow_threads){
+	flow_threads = std::max(flow_threads, 1);
+	bool parallel_flow = flow_threads > 1;
+
+	BoundedQueue<FrameData> decoded(std::max(QUEUE_DEPTH, 2 * flow_threads));
+	BoundedQueue<FrameData> flowed(QUEUE_DEPTH);
+	ReorderBuffer<FrameData> reordered(1, 2 * flow_threads);
+	BoundedQueue<FrameData> analyzed(QUEUE_DEPTH);
+	BoundedQueue<FrameData> rendered(QUEUE_DEPTH);
+
+	std::thread decode_thread([&]{
+		Mat prev_gray;
+		double last_time = -1;
+		int source_frame = -1;
+		for( int framecount = 0; true; framecount++){
+			FrameData data;
+			data.framecount = framecount;
+			data.source_frame = source_frame;
+			if ( !decode_stride(source, state.stride, last_time, data) ) break;
+			source_frame = data.source_frame;
+			if ( framecount > 0 ) printf("Frames read: %d\n",framecount);
+
+			if ( parallel_flow ) {
+				// Each pair carries both of its frames, the first frame only starts a pair
+				data.prev_gray = prev_gray;
+				prev_gray = data.gray;
+				if ( framecount == 0 ) continue;
+			}
+			if ( !decoded.push(std::move(data)) ) break;
+		}
+		decoded.close();
+	});
+
+	std::vector<std::thread> flow_workers;
+	std::atomic<int> flow_running(flow_threads);
+	if ( parallel_flow ) {
+		for ( int i = 0; i < flow_threads; i++ ) {
+			flow_workers.push_back(std::thread([&]{
+				FlowState flowstate;
+				init_flow(flowstate, flow, state.size, state.water, state.umat);
+				FrameData data;
+				while ( decoded.pop(data) ) {
+					compute_flow_pair(flowstate, data);
+					int framecount = data.framecount;
+					if ( !reordered.push(framecount, std::move(data)) ) break;
+				}
+				decoded.close();
+				if ( --flow_running == 0 ) reordered.close();
+			}));
+		}
+	} else {
+		flow_workers.push_back(std::thread([&]{
+			FlowState flowstate;
+			init_flow(flowstate, flow, state.size, state.water, state.umat);
+			FrameData data;
+			while ( decoded.pop(data) ) {
+				if ( !compute_flow(flowstate, data) ) continue;
+				if ( !flowed.push(std::move(data)) ) break;
+			}
+			decoded.close();
+			flowed.close();
+		}));
+	}
+
+	std::thread analysis_thread([&]{
+		FrameData data;
+		while ( parallel_flow ? reordered.pop(data) : flowed.pop(data) ) {
+			analyze_frame(state, data);
+			if ( !analyzed.push(std::move(data)) ) break;
+		}
+		flowed.close();
+		reordered.close();
+		analyzed.close();
+	});
+
+	std::thread render_thread([&]{
+		FrameData data;
+		while ( analyzed.pop(data) ) {
+			render_frame(render, data);
+			if ( !rendered.push(std::move(data)) ) break;
+		}
+		analyzed.close();
+		rendered.close();
+	});
+
+	FrameData data;
+	while ( rendered.pop(data) ) {
+		if ( !output_frame(outputs, data) ) break;
+	}
+
+	// Closing every queue unblocks whichever stage is still waiting
+	rendered.close();
+	analyzed.close();
+	reordered.close();
+	flowed.close();
+	decoded.close();
+
+	decode_thread.join();
+	for ( size_t i = 0; i < flow_workers.size(); i++ ) flow_workers[i].join();
+	analysis_thread.join();
+	render_thread.join();
+}
+
+// Runs the analysis on the flow of a cache instead of decoding and computing it, frame by frame.
+// Each flow is the mapped record itself, read only, see open_flow_cache(); the analysis rescales into its own Mats.
+// source - the video the cache was made from, only read for the products that draw on the frames; NULL for none
+void run_replay(const FlowCache& cache, VideoSource* source, RipState& state, RenderState& render, Outputs& outputs){
+	int decoded = -1;	// source frame last read from source
+	for ( int index = 0; index < cache.frames; index++ ) {
+		FrameData data;
+		FlowCacheRecord record;
+		read_flow_cache(cache, index, record, data.flow, data.grid_flow);
+		data.framecount = record.framecount;
+		data.source_frame = record.source_frame;
+		data.time = record.time;
+		data.dt = record.dt;
+		printf("Frames replayed: %d\n", data.framecount);
+
+		if ( source ) {
+			// the frame the flow ends on, those in between are only grabbed
+			if ( data.source_frame <= decoded ) break;
+			if ( !decode_frame(*source, data.source_frame - decoded - 1, data) ) break;
+			decoded = data.source_frame;
+			data.time = record.time;
+		}
+		if ( state.umat && !state.sparse ) {
+			data.flow.copyTo(data.u_flow);
+			data.flow.release();
+		}
+
+		analyze_frame(state, data);
+		render_frame(render, data);
+		if ( !output_frame(outputs, data) ) break;
+	}
+}
@@ -0,0 +1,321 @@
+#ifndef __PIPELINE_HPP_INCLUDE__
+#define __PIPELINE_HPP_INCLUDE__
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "ripcurrents.hpp"
+#include "flow_engine.hpp"
+#include "flow_cache.hpp"
+#include "histogram.hpp"
+#include "ingest.hpp"
+#include "particles.hpp"
+#include "water_mask.hpp"
+
+#define QUEUE_DEPTH 4 // Frames allowed in flight between two pipeline stages
+
+// Adaptive temporal stride
+#define STRIDE_MAX 8 // default cap, in source frames per analyzed frame
+#define STRIDE_TARGET 1.5 // pixels the fast water should move between two analyzed frames
+#define STRIDE_PERCENTILE 0.9 // what counts as the fast water
+#define STRIDE_SMOOTHING 0.2 // weight of a new frame in the smoothed speed
+#define STRIDE_DT_SNAP 0.1 // a dt within this part of a frame of the step is the step, timestamp jitter
+
+// Products that can be rendered, written and shown, product i is flag 1 << i and goes to <name>i.mp4
+#define PRODUCT_STREAMLINES 1
+#define PRODUCT_AVERAGE_VECTOR 2
+#define PRODUCT_AVERAGE_HSV 4
+#define PRODUCT_EDGES 8 // edges around the water that is rarely fast, the wave accumulation of the original program
+#define PRODUCT_FIELD 16 // how far every pixel's track point has moved, the dense streamline field; not with the sparse flow
+#define PRODUCT_COUNT 5
+#define PRODUCT_DEFAULT (PRODUCT_STREAMLINES | PRODUCT_AVERAGE_VECTOR | PRODUCT_AVERAGE_HSV)
+#define PRODUCT_ALL (PRODUCT_DEFAULT | PRODUCT_EDGES | PRODUCT_FIELD)
+
+// What an encoder does with a frame while its queue is full
+#define ENCODE_BLOCK 0 // wait, every frame is written and a slow encoder holds up the pipeline
+#define ENCODE_DROP 1 // drop it, a live source never waits for the encoder
+#define ENCODE_QUEUE 8 // default frames waiting per encoder
+
+// Fixed size queue joining two pipeline stages.
+// push() blocks while the queue is full, pop() blocks while it is empty.
+// After close(), push() fails at once and pop() fails once the queue is drained.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	bool push(T item){
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [&]{ return closed || items.size() < capacity; });
+		if ( closed ) return false;
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+		return true;
+	}
+
+	bool pop(T& item){
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [&]{ return closed || !items.empty(); });
+		if ( items.empty() ) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// push() that fails at once instead of waiting while the queue is full
+	bool try_push(T item){
+		std::lock_guard<std::mutex> lock(mutex);
+		if ( closed || items.size() >= capacity ) return false;
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+		return true;
+	}
+
+	void close(){
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+};
+
+// Hands items back strictly in index order, whatever order they were pushed in.
+// Used behind the frame-parallel flow workers, so the analysis still sees the frames in order.
+// push() blocks while its index is more than capacity ahead of the next one to pop.
+template <typename T>
+class ReorderBuffer {
+public:
+	ReorderBuffer(int first, size_t capacity) : next(first), capacity(capacity), closed(false) {}
+
+	bool push(int index, T item){
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]{ return closed || index < next + (int)capacity; });
+		if ( closed ) return false;
+		items[index] = std::move(item);
+		changed.notify_all();
+		return true;
+	}
+
+	bool pop(T& item){
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]{ return closed || items.count(next) > 0; });
+		typename std::map<int, T>::iterator it = items.find(next);
+		if ( it == items.end() ) return false;
+		item = std::move(it->second);
+		items.erase(it);
+		next++;
+		changed.notify_all();
+		return true;
+	}
+
+	void close(){
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::map<int, T> items;
+	int next;
+	size_t capacity;
+	bool closed;
+};
+
+// A VideoWriter that encodes on its own thread, behind a BoundedQueue.
+// write() hands the frame over; while the queue is full it waits or drops the frame, by policy.
+class AsyncWriter {
+public:
+	AsyncWriter() : opened(false), policy(ENCODE_BLOCK), dropped(0) {}
+	~AsyncWriter() { release(); }
+
+	bool open(const String& name, int fourcc, double fps, Size size, size_t capacity, int policy);
+	bool isOpened() const { return opened; }
+	void write(const Mat& frame);
+	void release();
+	long drops() const { return dropped; }
+
+private:
+	void run();
+
+	VideoWriter writer;	// only touched by the encoder thread while open
+	Ptr<BoundedQueue<Mat> > queue;
+	std::thread thread;
+	bool opened;
+	int policy;	// ENCODE_BLOCK or ENCODE_DROP
+	std::atomic<long> dropped;	// frames write() dropped
+};
+
+// Everything one frame carries through the stages.
+// Each stage only fills in its own fields, so no Mat is shared between frames in flight.
+struct FrameData {
+	int framecount;	// analyzed frames before this one
+	int source_frame;	// position in the video, differs from framecount with a stride
+	double time;	// timestamp in seconds, <= 0 if the source has none
+	float dt;	// source frames since the previous analyzed frame, from the timestamps when they make sense
+	Mat subframe;	// resized bgr frame
+	Mat gray;	// grayscale subframe, input to the flow
+	Mat prev_gray;	// gray of the previous frame, only set for the frame-parallel flow
+	Mat flow;	// CV_32FC2 flow from the previous frame to this one; sparse mode: interpolated by the analysis, if at all
+	Mat grid_flow;	// sparse mode: CV_32FC2 GRID_COUNT x GRID_COUNT flow, what the flow stage computes
+	Mat average_vector;	// snapshot of the running average vector
+	Mat average_hsv;	// snapshot of the running average color
+	Mat streamoverlay;	// snapshot of the discrete streamline traces
+	Mat streamout;	// rendered outputs
+	Mat average_vector_color;
+	Mat outmask;	// edges: CV_8UC1 the rarely fast water from the analysis, its edges after render
+	Mat edges;	// edges drawn over the frame
+	Mat streamfield;	// field: snapshot of streamlines_mat
+	Mat field;	// field: its displacement in color
+	UMat u_flow;	// UMat mode: the flow, which then is never in flow
+	UMat u_average_vector;	// UMat mode: the snapshots, average_hsv is only downloaded by the render stage
+	UMat u_average_hsv;
+};
+
+// State of the flow stage: the previous frame lives here between calls.
+// Every flow thread has its own, engines are not shared between threads.
+struct FlowState {
+	FlowState() : sparse(false), umat(false), warm_start(false), warm_refresh(0), warm_frames(0), last_dt(0) {}
+	bool sparse;	// pyramidal LK at the grid points instead of a dense engine
+	bool umat;	// the flow goes to data.u_flow and stays a UMat
+	Ptr<DenseOpticalFlow> engine;	// from create_flow_engine()
+	bool warm_start;	// compute_flow() starts every field from the last one
+	Ptr<DenseOpticalFlow> warm;	// the cheaper engine for that
+	int warm_refresh;	// a cold start every this many frames, 0 for never
+	int warm_frames;	// warm starts since the last cold one
+	float last_dt;	// dt of the last field, 0 before the first
+	Mat prev_grid_flow;	// sparse mode: the last grid field
+	Mat prev_grid_found;	// and the cells LK tracked in it, the others are no start
+	Rect roi;	// the flow is computed on this part of the frame, around the water
+	Mat land;	// flow is zeroed here, empty without a water mask
+	UMat u_land;	// the same for the UMat mode
+	Mat water_grid;	// sparse mode only tracks the grid points on water, empty for all
+	UMat u_f1, u_f2;
+	UMat u_flow;
+	Mat prev_gray;	// sparse mode keeps the previous frame here
+};
+
+// How many source frames to step per analyzed frame.
+// The analysis picks it, decode reads it from another thread, hence the atomic.
+struct FrameStride {
+	FrameStride() : fixed(1), max_stride(STRIDE_MAX), max_fps(0), fps(30), speed(0), current(1) {}
+	int fixed;	// stride to keep, 0 to adapt it
+	int max_stride;	// adaptive: never more than this
+	float max_fps;	// adaptive: compute budget, analyzed frames per second of video; 0 for none
+	double fps;	// nominal frame rate of the source
+	float speed;	// adaptive: smoothed speed of the fast water, pixels per source frame
+	std::atomic<int> current;
+};
+
+// State of the analysis stage, everything that has to see the frames in order.
+struct RipState {
+	Size size;	// analysis resolution, every frame is resized to this
+	int totalframes;
+	int products;	// PRODUCT_ flags, products nobody asked for are not computed
+	bool sparse;	// the flow comes from compute_sparse_flow(), see there
+	FrameStride stride;	// source frames per analyzed frame
+	Mat water;	// only water is analyzed, see water_mask.hpp; empty for the whole frame
+	Mat water_grid;	// the same at the grid points, for the sparse flow
+	FlowCache* cache;	// every flow is written here before it is analyzed, NULL for none
+
+	ThresholdHistogram histogram; //magnitude histograms of the recent frames
+	float UPPER; //UPPER can be determined programmatically
+	float UPPER2d[HIST_DIRECTIONS];
+	float prop_above_upper[HIST_DIRECTIONS];
+
+	Integrator integrator;	// how streamlines_mat and the particles are advected
+	bool interpolate_time;	// keep the last flow in integrator.previous
+
+	Mat streamlines_mat; //Track displacement from initial point, only for the field product
+	Mat streamlines_distance; //Track total distance traveled
+
+	Mat streamoverlay;
+	Particles particles;	// discrete streamlines
+
+	Mat accumulator;	// edges: CV_32FC3, in x how many frames each pixel (grid cell in sparse mode) was faster than UPPER
+
+	int average_mode;	// AVERAGE_BOX or AVERAGE_EMA
+	float alpha;	// weight of a new frame for AVERAGE_EMA, at a dt of one source frame
+	std::vector<Mat> buffer; // for average vector
+	int history_format;	// HISTORY_ encoding of buffer
+	Mat average_vector;
+	std::vector<Mat> buffer_hsv; // for average hsv color
+	Mat sum_hsv;
+	Mat accumulator_hsv;	// CV_32FC3 for AVERAGE_EMA
+	Mat average_hsv;
+	int update_ith_buffer;
+	std::vector<float> buffer_dt;	// dt of the frame in each slot of the box rings, 1 while empty
+	double buffer_time;	// their sum, the time the box averages cover
+
+	// UMat mode, see init_umat(): the same running averages as UMats, the Mat ones are released
+	bool umat;
+	UMat u_water;	// water as a UMat
+	UMat u_land;	// and its inverse, empty for the whole frame
+	std::vector<UMat> u_buffer;
+	UMat u_average_vector;
+	UMat u_delta;	// AVERAGE_EMA: scratch for the frame's delta, kept to reuse its buffer
+	std::vector<UMat> u_buffer_hsv;
+	UMat u_sum_hsv;
+	UMat u_accumulator_hsv;
+	UMat u_average_hsv;
+	UMat u_accumulator;	// edges: CV_32FC1, the counts of accumulator
+};
+
+// State of the render stage.
+struct RenderState {
+	int products;
+	bool umat;	// draw from the UMat snapshots
+	Mat streamoverlay_color;
+	double** grid;
+	float max_displacement;
+};
+
+// Video writers and windows for the products.
+// Writers that are not open are skipped, headless never touches highgui.
+struct Outputs {
+	int shown;	// PRODUCT_ flags of the products with a window
+	bool headless;
+	AsyncWriter writers[PRODUCT_COUNT];	// by product index, only the encoded products are open
+};
+
+void init_state(RipState& state, Size size, bool sparse, int totalframes, int products, int history_format, int average_mode, float time_constant,
+	int threshold_mode, int threshold_frames);
+void init_umat(RipState& state);
+void init_render(RenderState& render, Size size, int products);
+void release_render(RenderState& render);
+
+void init_stride(FrameStride& stride, int fixed, int max_stride, float max_fps, double fps);
+void update_stride(FrameStride& stride, const int hist[HIST_BINS], int pixels);
+
+bool decode_frame(VideoSource& source, int skip, FrameData& data);
+bool decode_stride(VideoSource& source, FrameStride& stride, double& last_time, FrameData& data);
+void init_flow(FlowState& flowstate, const FlowParams& params, Size size, const Mat& water, bool umat);
+bool compute_flow(FlowState& flowstate, FrameData& data);
+void compute_flow_pair(FlowState& flowstate, FrameData& data);
+void compute_sparse_flow(const Mat& prev_gray, const Mat& gray, const Mat& water_grid, const Mat& initial, const Mat& initial_found, Mat& grid_flow, Mat& found);
+void analyze_frame(RipState& state, FrameData& data);
+void render_frame(RenderState& render, FrameData& data);
+bool output_frame(Outputs& outputs, FrameData& data);
+
+void run_sequential(VideoSource& source, const FlowParams& flow, RipState& state, RenderState& render, Outputs& outputs);
+void run_pipelined(VideoSource& source, const FlowParams& flow, RipState& state, RenderState& render, Outputs& outputs, int flow_threads);
+void run_replay(const FlowCache& cache, VideoSource* source, RipState& state, RenderState& render, Outputs& outputs);
+
+#endif
@@ -76,7 +76,8 @@ int main(int argc, char** argv )
 	}
 	
 	// Set up for output videos
-	VideoWriter video_streamlines_only("video_streamlines.avi",CV_FOURCC('M','J','P','G'), 10, cv::Size(XDIM,YDIM),true);
+	// the streamline positions, video_streamlines.avi below is the drawn streamlines
+	VideoWriter video_streamlines_only("video_streamline_positions.avi",CV_FOURCC('M','J','P','G'), 10, cv::Size(XDIM,YDIM),true);
 	if (!video_streamlines_only.isOpened())
 	{
 		std::cout << "!!! Output video could not be opened" << std::endl;
@@ -1,8 +1,7 @@
 #ifndef __RIPCURRENTS_HPP_INCLUDE__
 #define __RIPCURRENTS_HPP_INCLUDE__
 
-#define XDIM 640   // Dimensions to resize to
-#define YDIM 480
+#define DEFAULT_XDIM 640   // Width to resize to, the height follows the aspect ratio of the input
 
 #define HIST_BINS 50 // Number of bins for finding thresholds
 #define HIST_DIRECTIONS 36 // Number of 2d histogram directions
@@ -10,19 +9,50 @@
 
 #define BUFFER_FRAME 300 // Number of buffered frames
 
+// Storage of the averageVector history ring
+#define HISTORY_FLOAT 0 // CV_32FC2, 8 bytes per pixel
+#define HISTORY_HALF 1 // fp16 in CV_16SC2, 4 bytes per pixel
+#define HISTORY_INT16 2 // fixed point in CV_16SC2, 4 bytes per pixel
+#define HISTORY_INT16_SCALE 256.0 // 1/256 pixel steps, +-128 pixels of range
+
+// Temporal averaging of averageVector and averageHSV
+#define AVERAGE_BOX 0 // exact average of the last BUFFER_FRAME frames
+#define AVERAGE_EMA 1 // exponential moving average, no history
+
 #define GRID_COUNT 30 // number of arrows per row and col
 
+// How streamline, streamline_field and the particles integrate through a frame
+#define INTEGRATE_EULER 0 // one flow sample per step
+#define INTEGRATE_MIDPOINT 1 // RK2, two samples per step
+#define INTEGRATE_RK4 2 // four samples per step, accurate with few large steps
+
 using namespace cv;
 
 typedef cv::Point3_<uchar> Pixelc;
 typedef cv::Point_<float> Pixel2;
 typedef cv::Point3_<float> Pixel3;
 
-void streamline_field(Pixel2 * pt, float* distancetraveled, int xoffset, int yoffset, cv::Mat flow, float dt, int iterations, float UPPER, float prop_above_upper[HIST_DIRECTIONS]);
-void streamline(Pixel2 * pt, cv::Scalar color, cv::Mat flow, cv::Mat overlay, float dt, int iterations, float UPPER, float prop_above_upper[HIST_DIRECTIONS]);
+// How a box average swaps a frame into its ring. Every slot weighs the source frames it stands for,
+// so with a stride the average is still one over time; a slot not filled yet counts as one frame of zeros.
+struct BoxWeights {
+	float in;	// dt of the incoming frame
+	float out;	// dt of the frame in the slot it replaces
+	double total;	// dt of all the slots, after the swap
+	BoxWeights() : in(1), out(1), total(BUFFER_FRAME) {}
+};
+
+struct Integrator {
+	int method;	// INTEGRATE_
+	int substeps;	// steps per frame, each covers dt / substeps
+	cv::Mat previous;	// flow of the frame before, the flow is interpolated in time from it to the current one; empty to hold the current one
+	Integrator() : method(INTEGRATE_EULER), substeps(1) {}
+};
+
+void streamline_field(Pixel2 * pts, float* distancetraveled, int n, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER, const Integrator& integrator);
+void streamline_field_rows(Mat& streamlines_mat, Mat& streamlines_distance, Mat flow, float dt, float UPPER, const Integrator& integrator, Mat water);
+void streamline(Pixel2 * pts, int n, cv::Scalar color, cv::Mat flow, cv::Mat overlay, float dt, float UPPER, const Integrator& integrator);
 void display_histogram(int hist2d[HIST_DIRECTIONS][HIST_BINS],int histsum2d[HIST_DIRECTIONS]
 					,float UPPER2d[HIST_DIRECTIONS], float UPPER, float prop_above_upper[HIST_DIRECTIONS]);
-double timediff();
 
 void streamline_displacement(Mat& streamfield, Mat& streamoverlay_color);
 void streamline_total_motion(Mat& streamlines_distance, Mat& streamoverlay_color);
@@ -30,27 +60,59 @@ void streamline_ratio(Mat& streamfield, Mat& streamlines_distance, Mat& streamov
 
 void streamline_positions(Mat& streamlines_mat, Mat& streamline_density);
 
-void get_streamlines(Mat& streamout, Mat& streamoverlay_color, Mat& streamoverlay, int streamlines, Pixel2 streampt[], int framecount, int totalframes, Mat& current, float UPPER, float prop_above_upper[]);
+void draw_streamlines(Mat& streamout, Mat& streamoverlay_color, Mat& streamoverlay);
 
 void create_histogram(Mat current, int hist[HIST_BINS], int& histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS]
 	 				,int histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]);
 
+void histogram_thresholds(int hist[HIST_BINS], int histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS]
+	 				,int histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]);
+void histogram_thresholds(double hist[HIST_BINS], double histsum, double hist2d[HIST_DIRECTIONS][HIST_BINS]
+	 				,double histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]);
+
 void stabilizer(Mat current, Mat current_prev);
 
 void globalOrientation(UMat u_f1, UMat u_f2, Mat& hist_gray);
 
-void averageHSV(Mat& subframe, std::vector<Mat> buffer_hsv, int update_ith_buffer, Mat& average_hsv);
+void averageHSV(Mat& subframe, std::vector<Mat>& buffer_hsv, int update_ith_buffer, Mat& sum_hsv, Mat& average_hsv, const BoxWeights& weights);
+void averageHSV(UMat& subframe, std::vector<UMat>& buffer_hsv, int update_ith_buffer, UMat& sum_hsv, UMat& average_hsv, const BoxWeights& weights);
 
-void averageVector(std::vector<Mat> buffer, Mat& current, int update_ith_buffer, Mat& average, Mat& average_color, double** grid, float max_displacement, float UPPER);
+int history_type(int history_format);
+void encode_history(const Mat& in, int history_format, Mat& out);
+void decode_history(const Mat& in, int history_format, Mat& out);
+void encode_history(const UMat& in, int history_format, UMat& out);
+void decode_history(const UMat& in, int history_format, UMat& out);
+
+void averageVector(std::vector<Mat>& buffer, int history_format, Mat& current, int update_ith_buffer, Mat& average, float UPPER, Mat water, const BoxWeights& weights);
+void averageVector(std::vector<UMat>& buffer, int history_format, UMat& current, int update_ith_buffer, UMat& average, float UPPER, UMat water, const BoxWeights& weights);
+void averageVectorGrid(std::vector<Mat>& buffer, int history_format, const Mat& grid_flow, int update_ith_buffer, Mat& average, float UPPER, const Mat& water_grid, const BoxWeights& weights);
+
+void averageVectorEMA(Mat& current, Mat& average, float alpha, float UPPER, Mat water);
+void averageVectorEMA(UMat& current, UMat& average, float alpha, float UPPER, UMat water, UMat& delta);
+void averageVectorGridEMA(const Mat& grid_flow, Mat& average, float alpha, float UPPER, const Mat& water_grid);
+
+void averageHSVEMA(Mat& subframe, Mat& accumulator_hsv, Mat& average_hsv, float alpha);
+void averageHSVEMA(UMat& subframe, UMat& accumulator_hsv, UMat& average_hsv, float alpha);
+
+void draw_average_vector(Mat& average, Mat& average_color, double** grid, float max_displacement);
+void draw_average_vector(UMat& average, Mat& average_color, double** grid, float max_displacement);
 
 void create_flow(Mat current, Mat waterclass, Mat accumulator2, float UPPER, float MID, float LOWER, float UPPER2d[HIST_DIRECTIONS]);
 
+void create_histogram_flow(Mat flow, int hist[HIST_BINS], int& histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS], int histsum2d[HIST_DIRECTIONS],
+					float UPPER, float MID, float LOWER, float UPPER2d[HIST_DIRECTIONS], Mat waterclass, Mat accumulator2, Mat display, Mat water);
+void create_histogram_umat(const UMat& flow, int hist[HIST_BINS], int& histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS], int histsum2d[HIST_DIRECTIONS],
+					const UMat& land, float UPPER, UMat fast);
+
 void create_accumulationbuffer(Mat& accumulator, Mat accumulator2, Mat& out, Mat outmask, int framecount);
 
 void create_edges(Mat& outmask);
 
 void create_output(Mat& subframe, Mat outmask);
 
-void get_delta(Pixel2 * pt, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER);
+void get_delta(Pixel2 * pts, int n, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER);
+void get_delta_rows(Mat& delta, Mat flow, float dt, float UPPER, Mat water);
+void get_delta_umat(const UMat& flow, float dt, float UPPER, const UMat& water, UMat& delta);
+void get_delta_grid(const Mat& grid_flow, float dt, float UPPER, const Mat& water_grid, Mat& delta);
 
 #endif
\ No newline at end of file
@@ -1,12 +1,14 @@
 #include <math.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <string.h>
+#include <mutex>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/ocl.hpp>  //Actually opencv3.2, in spite of the name
 #include <opencv2/optflow/motempl.hpp>
 
 #include "ripcurrents.hpp"
+#include "advection.hpp"
 
 // Mat streamfield		-input: how far it moved
 // Mat streamoverlay_color		-output color
@@ -14,6 +16,7 @@ void streamline_displacement(Mat& streamfield, Mat& streamoverlay_color){
 	//Compute streamline length
 	double lenmax;
 	minMaxLoc(streamfield,NULL,&lenmax,NULL,NULL);
+	if ( lenmax <= 0 ) lenmax = 0.000001; // nothing has moved yet
 	(streamfield).convertTo(streamoverlay_color,CV_8UC1,255/lenmax);
 	applyColorMap(streamoverlay_color, streamoverlay_color, COLORMAP_JET);
 }
@@ -42,9 +45,9 @@ void streamline_ratio(Mat& streamfield, Mat& streamlines_distance, Mat& streamov
 // Mat streamlines_mat		-input
 // Mat streamline_density		-output
 void streamline_positions(Mat& streamlines_mat, Mat& streamline_density){
-	for (int y = 0; y < YDIM; y++) {
+	for (int y = 0; y < streamlines_mat.rows; y++) {
 		Pixel2* ptr = streamlines_mat.ptr<Pixel2>(y, 0);
-		const Pixel2* ptr_end = ptr + (int)XDIM;
+		const Pixel2* ptr_end = ptr + streamlines_mat.cols;
 		for (int x = 0 ; ptr != ptr_end; ++ptr, x++) {
 			int xind = (int) roundf(floor(ptr->x + x));
 			int yind = (int) roundf(floor(ptr->y + y));
@@ -58,25 +61,59 @@ void streamline_positions(Mat& streamlines_mat, Mat& streamline_density){
 	}
 }
 
-// Mat streamout		-output
+// Mat streamout		-output: current frame with the streamlines drawn over it
 // Mat streamoverlay_color
-// Mat streamoverlay
-// int streamlines		-number of streamline track point
-// Pixel2 streampt[]	-array of streamline track point
-// int framecount
-// int totalframes
-// Mat current
-// float UPPER
-// float prop_above_upper
-void get_streamlines(Mat& streamout, Mat& streamoverlay_color, Mat& streamoverlay, int streamlines, Pixel2 streampt[], int framecount, int totalframes, Mat& current, float UPPER, float prop_above_upper[]){
-	for(int s = 0; s < streamlines; s++){
-		streamline(streampt+s, Scalar(framecount*(255.0/totalframes)), current, streamoverlay, 2, 1,UPPER,prop_above_upper);
-	}
-	
+// Mat streamoverlay		-input: streamline traces
+// pre: draw_particles()
+void draw_streamlines(Mat& streamout, Mat& streamoverlay_color, Mat& streamoverlay){
 	applyColorMap(streamoverlay, streamoverlay_color, COLORMAP_RAINBOW);
 	add(streamoverlay_color, streamout, streamout, streamoverlay, -1);
 }
 
+// Counters of one worker of the parallel histogram passes.
+// Workers count privately and merge once at the end of their stripe,
+// so the shared arrays see a lock per stripe instead of contention per pixel.
+// The 1d histogram is the 2d one summed over directions, so only that is kept.
+struct LocalHistogram {
+	int hist2d[HIST_DIRECTIONS][HIST_BINS];
+
+	LocalHistogram(){
+		memset(hist2d, 0, sizeof(hist2d));
+	}
+
+	void merge(std::mutex& mutex, int hist[HIST_BINS], int& histsum, int shared2d[HIST_DIRECTIONS][HIST_BINS], int histsum2d[HIST_DIRECTIONS]){
+		std::lock_guard<std::mutex> lock(mutex);
+		for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+			int sum = 0;
+			for ( int bin = 0; bin < HIST_BINS; bin++ ) {
+				hist[bin] += hist2d[angle][bin];
+				shared2d[angle][bin] += hist2d[angle][bin];
+				sum += hist2d[angle][bin];
+			}
+			histsum += sum;
+			histsum2d[angle] += sum;
+		}
+	}
+};
+
+// Calls run(start, end) for every run of water in one row of the water mask,
+// or once for the whole row without a mask. Land costs a byte compare per pixel.
+template <typename Run>
+static inline void for_each_run(const Mat& water, int row, int cols, Run run){
+	if ( water.empty() ) {
+		run(0, cols);
+		return;
+	}
+	const uchar* ptr = water.ptr<uchar>(row);
+	int x = 0;
+	while ( x < cols ) {
+		while ( x < cols && !ptr[x] ) x++;
+		int start = x;
+		while ( x < cols && ptr[x] ) x++;
+		if ( x > start ) run(start, x);
+	}
+}
+
 // Mat current
 // int hist[]		-
 // int histsum		-
@@ -90,24 +127,32 @@ void create_histogram(Mat current, int hist[HIST_BINS], int& histsum, int hist2d
 	
 	//Construct histograms to get thresholds
 	//Figure out what "slow" or "fast" is
-	for (int y = 0; y < YDIM; y++) {
-		Pixel3* ptr = current.ptr<Pixel3>(y, 0);
-		//const Pixel3* ptr_end = ptr + (int)XDIM;
-		const Pixel3* ptr_end = current.ptr<Pixel3>(y+1, 0);
-		for (; ptr < ptr_end; ++ptr) {
-			int bin = (ptr->y) * HIST_RESOLUTION;
-			int angle = (ptr->x * HIST_DIRECTIONS)/ 360; //order matters, truncation
-			if(bin < HIST_BINS &&  bin >= 0){
-				hist[bin]++; histsum++;
-				hist2d[angle][bin]++; histsum2d[angle]++;
+	std::mutex merge_mutex;
+	parallel_for_(Range(0, current.rows), [&](const Range& range) -> void {
+		LocalHistogram local;
+		for (int y = range.start; y < range.end; y++) {
+			Pixel3* ptr = current.ptr<Pixel3>(y, 0);
+			const Pixel3* ptr_end = ptr + current.cols;
+			for (; ptr < ptr_end; ++ptr) {
+				int bin = (ptr->y) * HIST_RESOLUTION;
+				int angle = (ptr->x * HIST_DIRECTIONS)/ 360; //order matters, truncation
+				if(bin < HIST_BINS &&  bin >= 0) local.hist2d[angle][bin]++;
 			}
 		}
-	}
+		local.merge(merge_mutex, hist, histsum, hist2d, histsum2d);
+	});
 	
+	histogram_thresholds(hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+}
+
+// Scan of histogram_thresholds(), for int counts and for the double ones of ThresholdHistogram
+template <typename Count>
+static void thresholds_from(const Count hist[HIST_BINS], Count histsum, const Count hist2d[HIST_DIRECTIONS][HIST_BINS]
+	 ,const Count histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]){
 	//Use histogram to create overall threshold
-	int threshsum = 0;
+	Count threshsum = 0;
 	int bin = HIST_BINS-1;
-	while(threshsum < (histsum*.05)){
+	while(bin >= 0 && threshsum < (histsum*.05)){
 		threshsum += hist[bin];
 		bin--;
 	}
@@ -119,28 +164,41 @@ void create_histogram(Mat current, int hist[HIST_BINS], int& histsum, int hist2d
 	//This is more of a visual aid, allowing small motion in directions with 
 	//little movement to not be drowned out by large-scale motion
 	for(int angle = 0; angle < HIST_DIRECTIONS; angle++){
-		int threshsum2 = 0;
+		Count threshsum2 = 0;
 		int bin = HIST_BINS-1;
-		while(threshsum2 < (histsum2d[angle]*.05)){
+		while(bin >= 0 && threshsum2 < (histsum2d[angle]*.05)){
 			threshsum2 += hist2d[angle][bin];
 			bin--;
 		}
 		UPPER2d[angle] = bin/float(HIST_RESOLUTION);
 		if(UPPER2d[angle] < 0.01) {UPPER2d[angle] = 0.01;}//avoid division by 0
 		
-		int threshsum3 = 0;
+		Count threshsum3 = 0;
 		bin = HIST_BINS-1;
 		while(bin > targetbin){
 			threshsum3 += hist2d[angle][bin];
 			bin--;
 		}
-		prop_above_upper[angle] = ((float)threshsum3)/threshsum;
+		prop_above_upper[angle] = threshsum ? ((float)threshsum3)/threshsum : 0;
 		
 		
 		//printf("Angle %d; prop_above_upper: %f\n",angle,prop_above_upper[angle]);
 	}
 }
 
+// hist, histsum, hist2d, histsum2d - input: histograms from create_histogram() or create_histogram_flow()
+// UPPER, UPPER2d, prop_above_upper - output: the thresholds they give
+void histogram_thresholds(int hist[HIST_BINS], int histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS]
+	 ,int histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]){
+	thresholds_from<int>(hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+}
+
+// As above, for the decayed or windowed counts of ThresholdHistogram
+void histogram_thresholds(double hist[HIST_BINS], double histsum, double hist2d[HIST_DIRECTIONS][HIST_BINS]
+	 ,double histsum2d[HIST_DIRECTIONS], float& UPPER, float UPPER2d[HIST_DIRECTIONS], float prop_above_upper[HIST_DIRECTIONS]){
+	thresholds_from<double>(hist, histsum, hist2d, histsum2d, UPPER, UPPER2d, prop_above_upper);
+}
+
 // Mat current
 // Mat waterclass
 // Mat accumulator2
@@ -179,6 +237,168 @@ void create_flow(Mat current, Mat waterclass, Mat accumulator2, float UPPER, flo
 	});
 }
 
+// Everything create_histogram() and create_flow() do, in one pass over the raw flow
+// instead of split, cartToPolar, merge and two more passes over the polar image.
+// flow - CV_32FC2 input
+// hist, histsum, hist2d, histsum2d - histograms, added to
+// UPPER, MID, LOWER, UPPER2d - thresholds to classify with, the ones in effect before this frame
+// accumulator2 - CV_32FC3 fast counter as create_flow() makes it, x is incremented where faster than UPPER; skipped if empty
+// waterclass - CV_32FC3 classification picture as create_flow() makes it, only with accumulator2; skipped if empty
+// display - CV_32FC3 output: the rescaled angle/magnitude image create_flow() leaves in current, skipped if empty
+// water - mask the size of flow, only water pixels are counted and classified; empty for all
+// pre: histogram_thresholds() afterwards for the new thresholds
+void create_histogram_flow(Mat flow, int hist[HIST_BINS], int& histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS], int histsum2d[HIST_DIRECTIONS],
+	 float UPPER, float MID, float LOWER, float UPPER2d[HIST_DIRECTIONS], Mat waterclass, Mat accumulator2, Mat display, Mat water){
+	bool classify = !accumulator2.empty();
+	bool classes = classify && !waterclass.empty();
+	bool show = !display.empty();
+	std::mutex merge_mutex;
+	
+	parallel_for_(Range(0, flow.rows), [&](const Range& range) -> void {
+		LocalHistogram local;
+		for (int y = range.start; y < range.end; y++) {
+			const Pixel2* ptr = flow.ptr<Pixel2>(y);
+			Pixel3* classptr = classes ? waterclass.ptr<Pixel3>(y) : NULL;
+			Pixel3* accptr = classify ? accumulator2.ptr<Pixel3>(y) : NULL;
+			Pixel3* showptr = show ? display.ptr<Pixel3>(y) : NULL;
+			for_each_run(water, y, flow.cols, [&](int start, int end) {
+				for (int x = start; x < end; x++) {
+					float val = sqrtf(ptr[x].x*ptr[x].x + ptr[x].y*ptr[x].y);
+					float theta = fastAtan2(ptr[x].y, ptr[x].x); // same approximation as cartToPolar
+					int angle = (int)(theta * HIST_DIRECTIONS / 360); //order matters, truncation
+					if ( angle >= HIST_DIRECTIONS ) angle = HIST_DIRECTIONS - 1;
+				
+					int bin = val * HIST_RESOLUTION;
+					if(bin < HIST_BINS &&  bin >= 0) local.hist2d[angle][bin]++;
+				
+					if ( classify && val > UPPER ) accptr[x].x++;
+					if ( classes ) {
+						if(val > UPPER){classptr[x].x = .5;}else{
+							if(val > MID){classptr[x].z = 1;}else{
+								if(val > LOWER){classptr[x].z = .5;}else{classptr[x].y = .5;}
+							}
+						}
+					}
+				
+					if ( show ) {
+						float z = val/UPPER2d[angle];
+						showptr[x] = Pixel3(theta, z > 1 ? 1 : .7, z);
+					}
+				}
+			});
+		}
+		local.merge(merge_mutex, hist, histsum, hist2d, histsum2d);
+	});
+}
+
+// in - CV_32FC1, scaled by scale and rounded down into out, CV_32S
+// convertTo rounds half to even, so a value that lands on a whole number after the scaling
+// (90 degrees, a speed on a bin edge) would go either way; where the rounding went up it is taken back
+static void floor_umat(const UMat& in, double scale, UMat& out){
+	UMat scaled, rounded, above;
+	in.convertTo(scaled, CV_32F, scale);
+	scaled.convertTo(out, CV_32S);
+	out.convertTo(rounded, CV_32F);
+	compare(rounded, scaled, above, CMP_GT);
+	subtract(out, Scalar::all(1), out, above);
+}
+
+// Counts the 16 bit indices of a UMat into count_bins, one counter per value below COUNT_BINS.
+// Every work group counts into local memory first, so the global atomics are one per bin and group.
+static const char* count_bins_source =
+	"__kernel void count_bins(__global const uchar* src, int src_step, int src_offset, int rows, int cols,\n"
+	"	__global int* counts){\n"
+	"	__local int local_counts[COUNT_BINS];\n"
+	"	int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);\n"
+	"	int lsize = get_local_size(0) * get_local_size(1);\n"
+	"	for ( int i = lid; i < COUNT_BINS; i += lsize ) local_counts[i] = 0;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	int x = get_global_id(0), y = get_global_id(1);\n"
+	"	if ( x < cols && y < rows )\n"
+	"		atomic_inc(local_counts + ((__global const ushort*)(src + src_offset + y * src_step))[x]);\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for ( int i = lid; i < COUNT_BINS; i += lsize )\n"
+	"		if ( local_counts[i] ) atomic_add(counts + i, local_counts[i]);\n"
+	"}\n";
+
+// index - CV_16UC1, every value below count
+// counts - output: how many pixels have each value, count of them
+// returns false without OpenCL, or when the kernel could not be built; count on the host then
+static bool count_bins_umat(const UMat& index, int count, std::vector<int>& counts){
+	if ( !ocl::useOpenCL() ) return false;
+	ocl::Kernel kernel("count_bins", ocl::ProgramSource(count_bins_source), "-D COUNT_BINS=" + std::to_string(count));
+	if ( kernel.empty() ) return false;
+	UMat device_counts = UMat::zeros(1, count, CV_32SC1);
+	kernel.args(ocl::KernelArg::ReadOnlyNoSize(index), index.rows, index.cols, ocl::KernelArg::PtrWriteOnly(device_counts));
+	size_t global[2] = { (size_t)index.cols, (size_t)index.rows };
+	if ( !kernel.run(2, global, NULL, true) ) return false;
+	Mat host = device_counts.getMat(ACCESS_READ);
+	counts.assign(host.ptr<int>(), host.ptr<int>() + count);
+	return true;
+}
+
+// flow - CV_32FC2 input
+// hist, histsum, hist2d, histsum2d - histograms, added to
+// land - mask of the pixels not to count; empty to count all
+// UPPER - threshold to classify with, the one in effect before this frame
+// fast - CV_8UC1 output: 255 where faster than UPPER and not on land, what create_histogram_flow() counts
+// in accumulator2; stays on the UMat. Skipped if empty, create it at the size of flow to get it
+// create_histogram_flow() for the UMat mode.
+// The polar form, the bins and with OpenCL their counts are computed on the UMat, only the counts come back.
+// Without OpenCL the 16 bit bin index per pixel is counted on the host, where the UMat is anyway.
+// The bins are those of the CPU version for the same speed and angle, but on OpenCL cartToPolar has its own atan,
+// so a pixel right at a direction edge can still land in the neighbouring direction.
+// pre: histogram_thresholds() afterwards for the new thresholds
+void create_histogram_umat(const UMat& flow, int hist[HIST_BINS], int& histsum, int hist2d[HIST_DIRECTIONS][HIST_BINS], int histsum2d[HIST_DIRECTIONS],
+	 const UMat& land, float UPPER, UMat fast){
+	std::vector<UMat> xy;
+	split(flow, xy);
+	UMat speed, theta;
+	cartToPolar(xy[0], xy[1], speed, theta, true);
+
+	if ( !fast.empty() ) {
+		compare(speed, Scalar::all(UPPER), fast, CMP_GT);
+		if ( !land.empty() ) fast.setTo(Scalar::all(0), land);
+	}
+
+	// rounded down like the truncation of the CPU version, speed and angle are never negative;
+	// index = direction * (HIST_BINS + 1) + bin, where bin HIST_BINS is too fast to count
+	UMat bins, directions, index;
+	floor_umat(speed, HIST_RESOLUTION, bins);
+	min(bins, Scalar::all(HIST_BINS), bins);
+	floor_umat(theta, HIST_DIRECTIONS / 360.0, directions);
+	min(directions, Scalar::all(HIST_DIRECTIONS - 1), directions);
+	addWeighted(directions, HIST_BINS + 1, bins, 1, 0, index, CV_16U);
+	const int land_index = HIST_DIRECTIONS * (HIST_BINS + 1);
+	if ( !land.empty() ) index.setTo(Scalar::all(land_index), land);
+
+	std::vector<int> device_counts;
+	if ( count_bins_umat(index, land_index + 1, device_counts) ) {
+		LocalHistogram local;
+		for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+			for ( int bin = 0; bin < HIST_BINS; bin++ ) local.hist2d[angle][bin] = device_counts[angle * (HIST_BINS + 1) + bin];
+		}
+		std::mutex merge_mutex;
+		local.merge(merge_mutex, hist, histsum, hist2d, histsum2d);
+		return;
+	}
+
+	Mat counted = index.getMat(ACCESS_READ);
+	std::mutex merge_mutex;
+	parallel_for_(Range(0, counted.rows), [&](const Range& range) -> void {
+		std::vector<int> counts(land_index + 1, 0);
+		for ( int y = range.start; y < range.end; y++ ) {
+			const ushort* ptr = counted.ptr<ushort>(y);
+			for ( int x = 0; x < counted.cols; x++ ) counts[ptr[x]]++;
+		}
+		LocalHistogram local;
+		for ( int angle = 0; angle < HIST_DIRECTIONS; angle++ ) {
+			for ( int bin = 0; bin < HIST_BINS; bin++ ) local.hist2d[angle][bin] = counts[angle * (HIST_BINS + 1) + bin];
+		}
+		local.merge(merge_mutex, hist, histsum, hist2d, histsum2d);
+	});
+}
+
 // Mat accumulator
 // Mat accumulator2
 // Mat out
@@ -221,7 +441,7 @@ void create_edges(Mat& outmask){
 // Mat outmask		:input
 // pre: accumulationbuffer(), create_edges()
 void create_output(Mat& subframe, Mat outmask){
-	Mat overlay = Mat::zeros(Size(XDIM, YDIM), CV_8UC3);
+	Mat overlay = Mat::zeros(subframe.size(), CV_8UC3);
 	
 	//Combine edges and original
 	if(true/*framecount>90*/){
@@ -311,7 +531,9 @@ void globalOrientation(UMat u_f1, UMat u_f2, Mat& hist_gray){
 	Mat black_diff;
 	threshold(color_diff, black_diff, 30, 1, THRESH_BINARY);
 	clock_t proc_time = clock();
-	Mat motion_history = Mat::zeros(Size(XDIM, YDIM), CV_32FC1);
+	int xdim = u_f1.cols;
+	int ydim = u_f1.rows;
+	Mat motion_history = Mat::zeros(u_f1.size(), CV_32FC1);
 	motempl::updateMotionHistory(black_diff, motion_history, proc_time, 1);
 	// min max normalize
 	double max, min;
@@ -326,17 +548,17 @@ void globalOrientation(UMat u_f1, UMat u_f2, Mat& hist_gray){
 	cvtColor(hist_color,hist_gray,COLOR_GRAY2BGR);
 
 	// draw center point
-	circle(hist_gray, Point((int)(XDIM / 2), (int)(YDIM / 2)), 3, Scalar(0, 215, 255), CV_FILLED, 16, 0);
+	circle(hist_gray, Point((int)(xdim / 2), (int)(ydim / 2)), 3, Scalar(0, 215, 255), CV_FILLED, 16, 0);
 
 	// draw line
 	double angle_rad = angle_deg * M_PI / 180;
-	arrowedLine(hist_gray, Point((int)(XDIM / 2), (int)(YDIM / 2)), 
-		Point((int)(XDIM / 2 + cos(angle_rad) * 10), (int)(YDIM / 2 + sin(angle_rad) * 50)),
+	arrowedLine(hist_gray, Point((int)(xdim / 2), (int)(ydim / 2)), 
+		Point((int)(xdim / 2 + cos(angle_rad) * 10), (int)(ydim / 2 + sin(angle_rad) * 50)),
 		Scalar(0, 215, 255), 2, 16, 0, 0.2);
 
 	// draw dots
-	for ( int row = 0; row < YDIM; row += 30 ){
-		for ( int col = 0; col < XDIM; col += 30 ){
+	for ( int row = 0; row < ydim; row += 30 ){
+		for ( int col = 0; col < xdim; col += 30 ){
 			circle(hist_gray, Point(col, row), 1, Scalar(0, 215, 0), CV_FILLED, 16, 0);
 			angle_deg = orientation.at<double>(row, col);
 			if ( angle_deg > 0 ) angle_rad = angle_deg * M_PI / 180;
@@ -348,45 +570,264 @@ void globalOrientation(UMat u_f1, UMat u_f2, Mat& hist_gray){
 }
 
 // subframe - bgr image of current frame
-// buffer_hsv - store hsv format data of previous BUFFER_COUNT frames
+// buffer_hsv - store the previous BUFFER_FRAME frames as they are
 // update_ith_buffer - number of element in buffer array to update
+// sum_hsv - CV_32FC3 running sum of buffer_hsv, each frame times its dt
 // average_hsv - average hsv of buffer_hsv
-void averageHSV(Mat& subframe, std::vector<Mat> buffer_hsv, int update_ith_buffer, Mat& average_hsv){
-	Mat hsv;
-	//cvtColor(subframe, hsv, COLOR_HSV2BGR);
+// weights - dt of the frame in and out, see BoxWeights
+void averageHSV(Mat& subframe, std::vector<Mat>& buffer_hsv, int update_ith_buffer, Mat& sum_hsv, Mat& average_hsv, const BoxWeights& weights){
+	Mat& slot = buffer_hsv[update_ith_buffer];
+	int width = subframe.cols * 3;
+	float total = weights.total;
 
-	// subtract old buffer data from average
-	average_hsv -= buffer_hsv[update_ith_buffer];
+	// swap the frame into the ring and keep the sum, the division only happens on the way out;
+	// while every dt is a whole number of frames the sums are exact integers
+	for ( int row = 0; row < subframe.rows; row++ ) {
+		const uchar* in = subframe.ptr<uchar>(row);
+		uchar* old = slot.ptr<uchar>(row);
+		float* sum = sum_hsv.ptr<float>(row);
+		uchar* avg = average_hsv.ptr<uchar>(row);
+		for ( int i = 0; i < width; i++ ) {
+			sum[i] += in[i] * weights.in - old[i] * weights.out;
+			old[i] = in[i];
+			avg[i] = saturate_cast<uchar>((int)(sum[i] / total));
+		}
+	}
+}
 
-	// get new buffer
-	buffer_hsv[update_ith_buffer] = subframe / BUFFER_FRAME;
-	// add new buffer to average
-	average_hsv += buffer_hsv[update_ith_buffer];
+// The same on UMats, for the UMat mode.
+void averageHSV(UMat& subframe, std::vector<UMat>& buffer_hsv, int update_ith_buffer, UMat& sum_hsv, UMat& average_hsv, const BoxWeights& weights){
+	UMat& slot = buffer_hsv[update_ith_buffer];
+	addWeighted(sum_hsv, 1, subframe, weights.in, 0, sum_hsv, CV_32F);
+	addWeighted(sum_hsv, 1, slot, -weights.out, 0, sum_hsv, CV_32F);
+	subframe.copyTo(slot);
+	// convertTo rounds, shifted by just under half a step it is the truncating division above
+	// (exactly so for whole frame dts, whose sums are integers)
+	sum_hsv.convertTo(average_hsv, CV_8U, 1.0 / weights.total, -0.5 + 0.5 / weights.total);
+}
+
+// history_format - HISTORY_FLOAT, HISTORY_HALF or HISTORY_INT16
+// returns the type of one averageVector history frame
+int history_type(int history_format){
+	return history_format == HISTORY_FLOAT ? CV_32FC2 : CV_16SC2;
+}
+
+// in - CV_32FC2 vectors
+// out - history frame in history_format
+void encode_history(const Mat& in, int history_format, Mat& out){
+	if ( history_format == HISTORY_HALF ) convertFp16(in, out);
+	else if ( history_format == HISTORY_INT16 ) in.convertTo(out, CV_16SC2, HISTORY_INT16_SCALE);
+	else in.copyTo(out);
+}
+
+// in - history frame in history_format
+// out - CV_32FC2 vectors
+void decode_history(const Mat& in, int history_format, Mat& out){
+	if ( history_format == HISTORY_HALF ) convertFp16(in, out);
+	else if ( history_format == HISTORY_INT16 ) in.convertTo(out, CV_32FC2, 1.0 / HISTORY_INT16_SCALE);
+	else in.copyTo(out);
+}
+
+// The same two on UMats.
+void encode_history(const UMat& in, int history_format, UMat& out){
+	if ( history_format == HISTORY_HALF ) convertFp16(in, out);
+	else if ( history_format == HISTORY_INT16 ) in.convertTo(out, CV_16SC2, HISTORY_INT16_SCALE);
+	else in.copyTo(out);
+}
+
+void decode_history(const UMat& in, int history_format, UMat& out){
+	if ( history_format == HISTORY_HALF ) convertFp16(in, out);
+	else if ( history_format == HISTORY_INT16 ) in.convertTo(out, CV_32FC2, 1.0 / HISTORY_INT16_SCALE);
+	else in.copyTo(out);
 }
 
-// buffer - store previous BUFFER_COUNT frames
+// buffer - history ring
+// incoming - CV_32FC2 new vectors, replaced by what the ring stores of them
+// update_ith_buffer - slot they go to, what was there leaves the average
+// weights - dt of the frame in and out, see BoxWeights
+static void update_history(std::vector<Mat>& buffer, int history_format, Mat& incoming, int update_ith_buffer, Mat& average, const BoxWeights& weights) {
+	// swap it into the ring, the average only ever sees the values as they are stored
+	// so what is subtracted later is exactly what is added now
+	Mat& slot = buffer[update_ith_buffer];
+	Mat outgoing;
+	decode_history(slot, history_format, outgoing);
+	encode_history(incoming, history_format, slot);
+	if ( history_format != HISTORY_FLOAT ) decode_history(slot, history_format, incoming);
+
+	// subtract old buffer data from average and add the new one, in one pass;
+	// the average was over the old total dt, it is rescaled to the new one
+	float keep = (weights.total - weights.in + weights.out) / weights.total;
+	float weight_in = weights.in / weights.total;
+	float weight_out = weights.out / weights.total;
+	int width = average.cols * 2;
+	for ( int row = 0; row < average.rows; row++ ) {
+		float* avg = average.ptr<float>(row);
+		const float* in = incoming.ptr<float>(row);
+		const float* old = outgoing.ptr<float>(row);
+		for ( int i = 0; i < width; i++ ) {
+			avg[i] = avg[i] * keep + in[i] * weight_in - old[i] * weight_out;
+		}
+	}
+}
+
+// buffer - store previous BUFFER_FRAME frames, encoded in history_format
+// history_format - HISTORY_FLOAT, HISTORY_HALF (fp16) or HISTORY_INT16 (fixed point)
 // current - frame data
 // update_ith_buffer - number of element in buffer array to update
 // average - store the average vector data
-// average_color - convert the vector data to hsv format image
-// grid - average of average in small grid
-// max_displacement - store the max displacement of vector
 // UPPER - histogram data to get clear result
-void averageVector(std::vector<Mat> buffer, Mat& current, int update_ith_buffer, Mat& average, Mat& average_color, double** grid, float max_displacement, float UPPER) {
-	// number of rows and cols in each grid
-	int grid_col_num = (int)(XDIM/GRID_COUNT);
-	int grid_row_num = (int)(YDIM/GRID_COUNT);
-	
-	// subtract old buffer data from average
-	average -= buffer[update_ith_buffer] / BUFFER_FRAME;
-	buffer[update_ith_buffer] = Mat::zeros(YDIM,XDIM,CV_32FC2);
+// water - mask, land adds nothing to the average; empty for the whole frame
+// weights - dt of the frame in and out, see BoxWeights
+void averageVector(std::vector<Mat>& buffer, int history_format, Mat& current, int update_ith_buffer, Mat& average, float UPPER, Mat water, const BoxWeights& weights) {
 	// get new buffer
-	buffer[update_ith_buffer].forEach<Pixel2>([&](Pixel2& pixel, const int position[]) -> void{
-		get_delta(&pixel, position[1],position[0], current, 2, UPPER);
+	Mat incoming = Mat::zeros(current.size(),CV_32FC2);
+	get_delta_rows(incoming, current, 2, UPPER, water);
+	update_history(buffer, history_format, incoming, update_ith_buffer, average, weights);
+}
+
+// The same on UMats, for the UMat mode.
+void averageVector(std::vector<UMat>& buffer, int history_format, UMat& current, int update_ith_buffer, UMat& average, float UPPER, UMat water, const BoxWeights& weights) {
+	UMat incoming;
+	get_delta_umat(current, 2, UPPER, water, incoming);
+
+	UMat& slot = buffer[update_ith_buffer];
+	UMat outgoing;
+	decode_history(slot, history_format, outgoing);
+	encode_history(incoming, history_format, slot);
+	if ( history_format != HISTORY_FLOAT ) decode_history(slot, history_format, incoming);
+
+	UMat change;
+	addWeighted(incoming, weights.in / weights.total, outgoing, -weights.out / weights.total, 0, change);
+	addWeighted(average, (weights.total - weights.in + weights.out) / weights.total, change, 1, 0, average);
+}
+
+// The same for the sparse flow, on the grid vectors only: the ring and the average are
+// GRID_COUNT x GRID_COUNT, a few kB where the dense ones take a full frame per slot.
+// grid_flow - CV_32FC2 GRID_COUNT x GRID_COUNT
+// water_grid - mask of the cells on water; empty for all
+void averageVectorGrid(std::vector<Mat>& buffer, int history_format, const Mat& grid_flow, int update_ith_buffer, Mat& average, float UPPER, const Mat& water_grid, const BoxWeights& weights) {
+	Mat incoming;
+	get_delta_grid(grid_flow, 2, UPPER, water_grid, incoming);
+	update_history(buffer, history_format, incoming, update_ith_buffer, average, weights);
+}
+
+// current - frame data
+// average - exponential moving average of the vector data, updated in place
+// alpha - weight of the new frame, 1/time constant in frames
+// UPPER - histogram data to get clear result
+// water - mask, land is left alone; empty for the whole frame
+// Needs no history, one pass over the water. The rules of get_delta() are folded into the blend,
+// see get_delta_umat(): the flow times 2, 0 on the outermost pixels and where faster than UPPER.
+void averageVectorEMA(Mat& current, Mat& average, float alpha, float UPPER, Mat water) {
+	parallel_for_(Range(0, average.rows), [&](const Range& range) -> void {
+		for ( int row = range.start; row < range.end; row++ ) {
+			Pixel2* pixel = average.ptr<Pixel2>(row);
+			const Pixel2* flow = current.ptr<Pixel2>(row);
+			bool inside_row = row >= 1 && row <= current.rows - 2;
+			for_each_run(water, row, average.cols, [&](int start, int end) {
+				for ( int col = start; col < end; col++ ) {
+					Pixel2 delta(0, 0);
+					if ( inside_row && col >= 1 && col <= current.cols - 2
+						&& sqrtf(flow[col].x*flow[col].x + flow[col].y*flow[col].y) <= UPPER ) delta = flow[col] * 2;
+					pixel[col] += (delta - pixel[col]) * alpha;
+				}
+			});
+		}
 	});
+}
+
+// The same for the sparse flow, on the grid vectors only, see averageVectorGrid().
+void averageVectorGridEMA(const Mat& grid_flow, Mat& average, float alpha, float UPPER, const Mat& water_grid) {
+	Mat delta;
+	get_delta_grid(grid_flow, 2, UPPER, water_grid, delta);
+	// cells off the water stay 0
+	accumulateWeighted(delta, average, alpha, water_grid);
+}
+
+// The same on UMats, for the UMat mode.
+// delta - scratch CV_32FC2 kept by the caller, reused from frame to frame
+void averageVectorEMA(UMat& current, UMat& average, float alpha, float UPPER, UMat water, UMat& delta) {
+	get_delta_umat(current, 2, UPPER, UMat(), delta);
+	accumulateWeighted(delta, average, alpha, water);
+}
+
+// subframe - bgr image of current frame
+// accumulator_hsv - CV_32FC3 exponential moving average, updated in place
+// average_hsv - accumulator_hsv in 8 bits
+// alpha - weight of the new frame, 1/time constant in frames
+void averageHSVEMA(Mat& subframe, Mat& accumulator_hsv, Mat& average_hsv, float alpha){
+	int width = subframe.cols * 3;
+	for ( int row = 0; row < subframe.rows; row++ ) {
+		const uchar* in = subframe.ptr<uchar>(row);
+		float* acc = accumulator_hsv.ptr<float>(row);
+		uchar* avg = average_hsv.ptr<uchar>(row);
+		for ( int i = 0; i < width; i++ ) {
+			acc[i] += (in[i] - acc[i]) * alpha;
+			avg[i] = saturate_cast<uchar>(acc[i]);
+		}
+	}
+}
+
+// The same on UMats, for the UMat mode.
+void averageHSVEMA(UMat& subframe, UMat& accumulator_hsv, UMat& average_hsv, float alpha){
+	accumulateWeighted(subframe, accumulator_hsv, alpha);
+	accumulator_hsv.convertTo(average_hsv, CV_8U);
+}
+
+// average_color - image to draw on
+// color - of the arrow
+// global_angle_rad - direction of the whole average
+// The global orientation arrow from the center of the image.
+static void draw_global_arrow(Mat& average_color, Scalar color, double global_angle_rad){
+	int xdim = average_color.cols;
+	int ydim = average_color.rows;
+	circle(average_color, Point((int)(xdim/2), (int)(ydim/2)), 3, color, CV_FILLED, 16, 0);
+	arrowedLine(average_color, Point((int)(xdim / 2), (int)(ydim / 2)), 
+		Point((int)(xdim / 2 + cos(global_angle_rad) * 10), (int)(ydim / 2 + sin(global_angle_rad) * 50)),
+		color, 2, 16, 0, 0.2);
+}
+
+// average_color - bgr image to draw on
+// grid - sum of the angles in degrees of each grid
+// co - pixels in a grid, the grid sums over it are the mean angles
+// global_angle_rad - direction of the whole average
+// grid_col_num, grid_row_num - size of a grid in pixels
+// Draws the arrows of the grids that go against the global orientation.
+static void draw_grid_arrows(Mat& average_color, double** grid, int co, double global_angle_rad, int grid_col_num, int grid_row_num){
+	// draw arrows for each grid
+	for ( int row = 1; row < GRID_COUNT; row++ ){
+		for ( int col = 1; col < GRID_COUNT; col++ ){
+			double angle_deg = grid[row][col] / co;
+			double angle_rad = angle_deg  * M_PI / 180;
+			// find in-between angle
+			double angle_between = min(abs(angle_rad - global_angle_rad), 2*M_PI-abs(angle_rad - global_angle_rad));
+			if ( angle_between > M_PI * 0.7 ) {
+				circle(average_color, Point(col * grid_col_num, row * grid_row_num), 1, Scalar(0, 255, 0), CV_FILLED, 16, 0);
+				arrowedLine(average_color, Point(col * grid_col_num, row * grid_row_num), 
+					Point((int)(col * grid_col_num + cos(angle_rad) * 10), (int)(row * grid_row_num + sin(angle_rad) * 10)),
+					Scalar(0, 255, 0), 1, 16, 0, 0.4);
+			} /*else {
+				circle(average_color, Point(col * grid_col_num, row * grid_row_num), 1, Scalar(255, 0, 0), CV_FILLED, 16, 0);
+				arrowedLine(average_color, Point(col * grid_col_num, row * grid_row_num), 
+					Point((int)(col * grid_col_num + cos(angle_rad) * 10), (int)(row * grid_row_num + sin(angle_rad) * 10)),
+					Scalar(255, 0, 0), 1, 16, 0, 0.4);
+			}*/
+		}
+	}
+}
 
-	// add new buffer to average
-	average += buffer[update_ith_buffer] / BUFFER_FRAME;
+// average - the average vector data
+// average_color - convert the vector data to hsv format image
+// grid - average of average in small grid
+// max_displacement - the least length that gets full brightness, so a still frame stays dark
+// The brightness is relative to the largest vector of the frame.
+// pre: averageVector()
+void draw_average_vector(Mat& average, Mat& average_color, double** grid, float max_displacement) {
+	// number of rows and cols in each grid
+	int xdim = average.cols;
+	int ydim = average.rows;
+	int grid_col_num = (int)(xdim/GRID_COUNT);
+	int grid_row_num = (int)(ydim/GRID_COUNT);
 
 	float global_theta = 0;
 	float global_magnitude = 0;
@@ -399,13 +840,21 @@ void averageVector(std::vector<Mat> buffer, Mat& current, int update_ith_buffer,
 		}
 	}
 
+	// the largest vector first, a running maximum would overflow the value on every new one
+	float largest = max_displacement;
+	for ( int row = 0; row < average.rows; row++ ) {
+		const Pixel2* ptr = average.ptr<Pixel2>(row, 0);
+		for ( int col = 0; col < average.cols; col++ ) largest = std::max(largest, sqrtf(ptr[col].x * ptr[col].x + ptr[col].y * ptr[col].y));
+	}
+
 	// store vector data of average
 	int co = 0;
 	for ( int row = 0; row < average.rows; row++ ) {
 		Pixel2* ptr = average.ptr<Pixel2>(row, 0);
 		Pixelc* ptr2 = average_color.ptr<Pixelc>(row, 0);
 
-		if ( row >= grid_row_num * grid_row)
+		// the last grid takes the rows left over when ydim is not a multiple of GRID_COUNT
+		if ( row >= grid_row_num * grid_row && grid_row < GRID_COUNT)
 			grid_row++;
 		
 		grid_col = 1;
@@ -417,16 +866,13 @@ void averageVector(std::vector<Mat> buffer, Mat& current, int update_ith_buffer,
 			// store vector data
 			ptr2->x = theta / 2;
 			ptr2->y = 255;
-			ptr2->z = sqrt(ptr->x * ptr->x + ptr->y * ptr->y)*255/max_displacement;
+			ptr2->z = sqrtf(ptr->x * ptr->x + ptr->y * ptr->y)*255/largest;
 			//if ( ptr2->z < 30 ) ptr2->z = 0;
 
-			// store the previous max to maxmin next frame
-			if ( sqrt(ptr->x * ptr->x + ptr->y * ptr->y) > max_displacement ) max_displacement = sqrt(ptr->x * ptr->x + ptr->y * ptr->y);
-
 			global_theta += ptr2->x * ptr2->z;
 			global_magnitude += ptr2->z;
 
-			if ( col >= grid_col_num * grid_col)
+			if ( col >= grid_col_num * grid_col && grid_col < GRID_COUNT)
 				grid_col++;
 
 			// add the vector to the corresponding grid
@@ -441,159 +887,197 @@ void averageVector(std::vector<Mat> buffer, Mat& current, int update_ith_buffer,
 	}
 
 	// draw global orientation arrow
-	circle(average_color, Point((int)(XDIM/2), (int)(YDIM/2)), 3, Scalar(0, 215, 255), CV_FILLED, 16, 0);
 	double global_angle_rad = global_theta * 2 / global_magnitude * M_PI / 180;
-	arrowedLine(average_color, Point((int)(XDIM / 2), (int)(YDIM / 2)), 
-		Point((int)(XDIM / 2 + cos(global_angle_rad) * 10), (int)(YDIM / 2 + sin(global_angle_rad) * 50)),
-		Scalar(0, 215, 255), 2, 16, 0, 0.2);
+	draw_global_arrow(average_color, Scalar(0, 215, 255), global_angle_rad);
 
 	// show as hsv format
 	cvtColor(average_color, average_color, CV_HSV2BGR);
 
-	// draw arrows for each grid
-	for ( int row = 1; row < GRID_COUNT; row++ ){
-		for ( int col = 1; col < GRID_COUNT; col++ ){
-			double angle_deg = grid[row][col] / co;
-			double angle_rad = angle_deg  * M_PI / 180;
-			// find in-between angle
-			double angle_between = min(abs(angle_rad - global_angle_rad), 2*M_PI-abs(angle_rad - global_angle_rad));
-			if ( angle_between > M_PI * 0.7 ) {
-				circle(average_color, Point(col * grid_col_num, row * grid_row_num), 1, Scalar(0, 255, 0), CV_FILLED, 16, 0);
-				arrowedLine(average_color, Point(col * grid_col_num, row * grid_row_num), 
-					Point((int)(col * grid_col_num + cos(angle_rad) * 10), (int)(row * grid_row_num + sin(angle_rad) * 10)),
-					Scalar(0, 255, 0), 1, 16, 0, 0.4);
-			} /*else {
-				circle(average_color, Point(col * grid_col_num, row * grid_row_num), 1, Scalar(255, 0, 0), CV_FILLED, 16, 0);
-				arrowedLine(average_color, Point(col * grid_col_num, row * grid_row_num), 
-					Point((int)(col * grid_col_num + cos(angle_rad) * 10), (int)(row * grid_row_num + sin(angle_rad) * 10)),
-					Scalar(255, 0, 0), 1, 16, 0, 0.4);
-			}*/
-		}
+	draw_grid_arrows(average_color, grid, co, global_angle_rad, grid_col_num, grid_row_num);
+}
+
+// theta - CV_32FC1 angles in degrees
+// grid - output: sum of the angles of each grid, the grids as draw_average_vector() cuts them
+// grid_col_num, grid_row_num - size of a grid in pixels, at least 1
+// The uniform grids are box averages of a resize, the last row and col of grids also take
+// the pixels left over when the size is not a multiple of GRID_COUNT.
+static void grid_sums(const UMat& theta, double** grid, int grid_col_num, int grid_row_num){
+	int inner_cols = grid_col_num * GRID_COUNT;
+	int inner_rows = grid_row_num * GRID_COUNT;
+	int right = theta.cols - inner_cols;
+	int bottom = theta.rows - inner_rows;
+
+	UMat means;
+	resize(theta(Rect(0, 0, inner_cols, inner_rows)), means, Size(GRID_COUNT, GRID_COUNT), 0, 0, INTER_AREA);
+	Mat cells = means.getMat(ACCESS_READ);
+	for ( int row = 0; row < GRID_COUNT; row++ ) {
+		for ( int col = 0; col < GRID_COUNT; col++ ) grid[row][col] = cells.at<float>(row, col) * grid_col_num * grid_row_num;
+	}
+
+	if ( right > 0 ) {
+		UMat strip;
+		resize(theta(Rect(inner_cols, 0, right, inner_rows)), strip, Size(1, GRID_COUNT), 0, 0, INTER_AREA);
+		Mat sums = strip.getMat(ACCESS_READ);
+		for ( int row = 0; row < GRID_COUNT; row++ ) grid[row][GRID_COUNT-1] += sums.at<float>(row, 0) * right * grid_row_num;
+	}
+	if ( bottom > 0 ) {
+		UMat strip;
+		resize(theta(Rect(0, inner_rows, inner_cols, bottom)), strip, Size(GRID_COUNT, 1), 0, 0, INTER_AREA);
+		Mat sums = strip.getMat(ACCESS_READ);
+		for ( int col = 0; col < GRID_COUNT; col++ ) grid[GRID_COUNT-1][col] += sums.at<float>(0, col) * grid_col_num * bottom;
 	}
+	if ( right > 0 && bottom > 0 ) grid[GRID_COUNT-1][GRID_COUNT-1] += sum(theta(Rect(inner_cols, inner_rows, right, bottom)))[0];
 }
 
-void streamline(Pixel2 * pt, cv::Scalar color, cv::Mat flow, cv::Mat overlay, float dt, int iterations, float UPPER, float prop_above_upper[HIST_DIRECTIONS]){
-	
-	
-	for( int i = 0; i< iterations; i++){
-		
-		float x = pt->x;
-		float y = pt->y;
-		
-		int xind = (int) floor(x);
-		int yind = (int) floor(y);
-		float xrem = x - xind;
-		float yrem = y - yind;
-		
-		if(xind < 1 || yind < 1 || xind + 2 > flow.cols || yind  + 2 > flow.rows)  //Verify array bounds
-		{
-			return;
+// The same for the UMat mode: the polar form, the hsv image and the sums for the arrows stay on the UMat,
+// only the hsv image comes back to draw the arrows on and convert, as above.
+// The image is the one above up to float rounding: the angles are cartToPolar's rather than atan2's,
+// so a hue or a brightness right at a step, or a grid arrow right at its threshold, can come out one off.
+void draw_average_vector(UMat& average, Mat& average_color, double** grid, float max_displacement) {
+	// number of rows and cols in each grid
+	int xdim = average.cols;
+	int ydim = average.rows;
+	int grid_col_num = (int)(xdim/GRID_COUNT);
+	int grid_row_num = (int)(ydim/GRID_COUNT);
+
+	std::vector<UMat> xy;
+	split(average, xy);
+	UMat speed, theta;
+	cartToPolar(xy[0], xy[1], speed, theta, true);
+	double largest = 0;
+	minMaxLoc(speed, NULL, &largest);
+	largest = std::max(largest, (double)max_displacement);
+
+	// hue is half the angle, value the length, truncated as above
+	std::vector<UMat> hsv(3);
+	UMat truncated;
+	floor_umat(theta, 0.5, truncated);
+	truncated.convertTo(hsv[0], CV_8U);
+	hsv[1].create(average.size(), CV_8UC1);
+	hsv[1].setTo(Scalar::all(255));
+	floor_umat(speed, 255 / largest, truncated);
+	truncated.convertTo(hsv[2], CV_8U);
+
+	// global orientation, the hue weighted by the value
+	UMat weighted;
+	multiply(hsv[0], hsv[2], weighted, 1, CV_32F);
+	double global_theta = sum(weighted)[0];
+	double global_magnitude = sum(hsv[2])[0];
+	double global_angle_rad = global_theta * 2 / global_magnitude * M_PI / 180;
+
+	for ( int i = 0; i < GRID_COUNT; i++ ) {
+		for ( int j = 0; j < GRID_COUNT; j++ ) {
+			grid[i][j] = 0;
 		}
-		
-		//Bilinear interpolation
-		Pixel2 delta =		(*flow.ptr<Pixel2>(yind,xind))		* (1-xrem)*(1-yrem) +
-		(*flow.ptr<Pixel2>(yind,xind+1))	* (xrem)*(1-yrem) +
-		(*flow.ptr<Pixel2>(yind+1,xind))	* (1-xrem)*(yrem) +
-		(*flow.ptr<Pixel2>(yind+1,xind+1))	* (xrem)*(yrem) ;
-		
-		
-		float theta = atan2(delta.y,delta.x)*180/M_PI;//find angle
-		theta += theta < 0 ? 360 : 0; //enforce strict positive angle
-		int direction = ((int)((theta * HIST_DIRECTIONS)/360));
-		//if(prop_above_upper[direction] > .05){return;}
-		
-		float r = sqrt(delta.x*delta.x + delta.y*delta.y);
-		if(r > UPPER){return;}
-		
-		
-		Pixel2 newpt = *pt + delta*dt/iterations;
-		
-		cv::line(overlay,* pt, newpt, color, 1, 8, 0);
-		
-		*pt = newpt;
 	}
-	
-	return;
+	int co = grid_col_num * grid_row_num;
+	if ( co > 0 ) grid_sums(theta, grid, grid_col_num, grid_row_num);
+
+	UMat hsv_image;
+	merge(hsv, hsv_image);
+	hsv_image.copyTo(average_color);
+
+	// the global arrow goes on the hsv image, as above, so its antialiasing blends the same
+	draw_global_arrow(average_color, Scalar(0, 215, 255), global_angle_rad);
+	cvtColor(average_color, average_color, CV_HSV2BGR);
+	if ( co > 0 ) draw_grid_arrows(average_color, grid, co, global_angle_rad, grid_col_num, grid_row_num);
 }
 
-void streamline_field(Pixel2 * pt, float* distancetraveled, int xoffset, int yoffset, cv::Mat flow, float dt, int iterations, float UPPER, float prop_above_upper[HIST_DIRECTIONS]){
-	
-	
-	for( int i = 0; i< iterations; i++){
-		
-		float x = pt->x + xoffset;
-		float y = pt->y + yoffset;
-		
-		int xind = (int) floor(x);
-		int yind = (int) floor(y);
-		float xrem = x - xind;
-		float yrem = y - yind;
-		
-		if(xind < 1 || yind < 1 || xind + 2 > flow.cols || yind  + 2 > flow.rows)  //Verify array bounds
-		{
-			return;
+// pts - streamline track points, advanced in place
+// n - number of points
+// color, overlay - every step is drawn on the overlay in this color
+// integrator - method, sub-steps and previous flow
+void streamline(Pixel2 * pts, int n, cv::Scalar color, cv::Mat flow, cv::Mat overlay, float dt, float UPPER, const Integrator& integrator){
+	DrawSink sink(overlay, color);
+	advect_with<DrawSink, false, true>(integrator.method, pts, n, 0, 0, flow, integrator.previous, dt, integrator.substeps, UPPER, sink);
+}
+
+// pts - track points of a run of pixels in one row, pts[k] started at (xoffset + k, yoffset)
+// distancetraveled - total distance of each point, accumulated
+// n - number of points
+// integrator - method, sub-steps and previous flow
+void streamline_field(Pixel2 * pts, float* distancetraveled, int n, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER, const Integrator& integrator){
+	DistanceSink sink(distancetraveled);
+	advect_with<DistanceSink, true, true>(integrator.method, pts, n, xoffset, yoffset, flow, integrator.previous, dt, integrator.substeps, UPPER, sink);
+}
+
+// streamlines_mat - CV_32FC2 displacement of every pixel's track point
+// streamlines_distance - CV_32FC1 distance of every pixel's track point
+// water - mask, only the track points of water pixels move; empty for all
+// Runs streamline_field() over the runs of water in every row, rows in parallel.
+void streamline_field_rows(Mat& streamlines_mat, Mat& streamlines_distance, Mat flow, float dt, float UPPER, const Integrator& integrator, Mat water){
+	parallel_for_(Range(0, streamlines_mat.rows), [&](const Range& range) -> void {
+		for ( int row = range.start; row < range.end; row++ ) {
+			for_each_run(water, row, streamlines_mat.cols, [&](int start, int end) {
+				streamline_field(streamlines_mat.ptr<Pixel2>(row) + start, streamlines_distance.ptr<float>(row) + start, end - start,
+					start, row, flow, dt, UPPER, integrator);
+			});
 		}
-		
-		//Bilinear interpolation
-		Pixel2 delta =		(*flow.ptr<Pixel2>(yind,xind))		* (1-xrem)*(1-yrem) +
-		(*flow.ptr<Pixel2>(yind,xind+1))	* (xrem)*(1-yrem) +
-		(*flow.ptr<Pixel2>(yind+1,xind))	* (1-xrem)*(yrem) +
-		(*flow.ptr<Pixel2>(yind+1,xind+1))	* (xrem)*(yrem) ;
-		
-		
-		float theta = atan2(delta.y,delta.x)*180/M_PI;//find angle
-		theta += theta < 0 ? 360 : 0; //enforce strict positive angle
-		int direction = ((int)((theta * HIST_DIRECTIONS)/360));
-		//if(prop_above_upper[direction] > .05){return;}
-		
-		float r = sqrt(delta.x*delta.x + delta.y*delta.y);
-		if(r > UPPER){return;}
-		
-		Pixel2 newpt = *pt + delta*dt/iterations;
-		*distancetraveled = *distancetraveled + r;
-		
-		*pt = newpt;
-	}
-	
-	return;
+	});
 }
 
-void get_delta(Pixel2 * pt, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER){
-	
-	float x = pt->x + xoffset;
-	float y = pt->y + yoffset;
-	
-	int xind = (int) floor(x);
-	int yind = (int) floor(y);
-	float xrem = x - xind;
-	float yrem = y - yind;
-	
-	if(xind < 1 || yind < 1 || xind + 2 > flow.cols || yind  + 2 > flow.rows)  //Verify array bounds
-	{
-		return;
+// pts - values of a run of pixels in one row, pts[k] is at (xoffset + k, yoffset)
+// n - number of points
+// Adds the flow at each pixel times dt, unless it is off the edge or faster than UPPER.
+void get_delta(Pixel2 * pts, int n, int xoffset, int yoffset, cv::Mat flow, float dt, float UPPER){
+	NoSink sink;
+	advect<NoSink, true, INTEGRATE_EULER, true>(pts, n, xoffset, yoffset, flow, Mat(), dt, 1, UPPER, sink);
+}
+
+// delta - CV_32FC2 the size of the flow, the flow at each pixel times dt is added to it
+// water - mask, land is left alone; empty for the whole frame
+// Runs get_delta() over the runs of water in every row, rows in parallel.
+void get_delta_rows(Mat& delta, Mat flow, float dt, float UPPER, Mat water){
+	parallel_for_(Range(0, delta.rows), [&](const Range& range) -> void {
+		for ( int row = range.start; row < range.end; row++ ) {
+			for_each_run(water, row, delta.cols, [&](int start, int end) {
+				get_delta(delta.ptr<Pixel2>(row) + start, end - start, start, row, flow, dt, UPPER);
+			});
+		}
+	});
+}
+
+// grid_flow - CV_32FC2 GRID_COUNT x GRID_COUNT, the sparse flow at the cell centers
+// dt, UPPER - as for get_delta()
+// water_grid - mask of the cells on water, the others get 0; empty for all
+// delta - output: CV_32FC2, the vectors times dt, 0 where faster than UPPER
+// get_delta_rows() for the sparse flow, no cell center is near the edge so only the speed counts.
+void get_delta_grid(const Mat& grid_flow, float dt, float UPPER, const Mat& water_grid, Mat& delta){
+	delta = Mat::zeros(grid_flow.size(), CV_32FC2);
+	for ( int row = 0; row < grid_flow.rows; row++ ) {
+		const Pixel2* in = grid_flow.ptr<Pixel2>(row);
+		const uchar* water = water_grid.empty() ? NULL : water_grid.ptr<uchar>(row);
+		Pixel2* out = delta.ptr<Pixel2>(row);
+		for ( int col = 0; col < grid_flow.cols; col++ ) {
+			if ( water && !water[col] ) continue;
+			if ( sqrtf(in[col].x * in[col].x + in[col].y * in[col].y) > UPPER ) continue;
+			out[col] = in[col] * dt;
+		}
 	}
-	
-	//Bilinear interpolation
-	Pixel2 delta =		(*flow.ptr<Pixel2>(yind,xind))		* (1-xrem)*(1-yrem) +
-	(*flow.ptr<Pixel2>(yind,xind+1))	* (xrem)*(1-yrem) +
-	(*flow.ptr<Pixel2>(yind+1,xind))	* (1-xrem)*(yrem) +
-	(*flow.ptr<Pixel2>(yind+1,xind+1))	* (xrem)*(yrem) ;
-	
-	float r = sqrt(delta.x*delta.x + delta.y*delta.y);
-	if(r > UPPER){return;}
-	
-	Pixel2 newpt = *pt + delta*dt;
-	
-	*pt = newpt;
-	
-	return;
 }
 
-double timediff(){
-	static struct timeval oldtime;
-	struct timeval newtime;
-	gettimeofday(&newtime,NULL);
-	double diff = (newtime.tv_sec - oldtime.tv_sec) + (newtime.tv_usec - oldtime.tv_usec)/1000000.0;
-	gettimeofday(&oldtime,NULL);
-	return diff;
-}
\ No newline at end of file
+// flow - CV_32FC2
+// dt, UPPER - as for get_delta()
+// water - mask, land gets 0; empty for the whole frame
+// delta - output: CV_32FC2, the flow times dt where get_delta() would add it to zeros, 0 elsewhere
+// get_delta_rows() on UMats: at whole pixels the sample is the pixel itself, so the rules of
+// get_delta() come down to a mask, slow enough and off the outermost pixels sample_flow() skips.
+void get_delta_umat(const UMat& flow, float dt, float UPPER, const UMat& water, UMat& delta){
+	std::vector<UMat> xy;
+	split(flow, xy);
+	UMat speed, keep;
+	magnitude(xy[0], xy[1], speed);
+	compare(speed, Scalar::all(UPPER), keep, CMP_LE);
+
+	UMat inside = UMat::zeros(flow.size(), CV_8UC1);
+	if ( flow.cols > 2 && flow.rows > 2 ) inside(Rect(1, 1, flow.cols - 2, flow.rows - 2)).setTo(Scalar::all(255));
+	bitwise_and(keep, inside, keep);
+	if ( !water.empty() ) bitwise_and(keep, water, keep);
+
+	UMat scaled;
+	flow.convertTo(scaled, -1, dt);
+	// create() keeps the buffer of a delta that is already the right size
+	delta.create(flow.size(), CV_32FC2);
+	delta.setTo(Scalar::all(0));
+	scaled.copyTo(delta, keep);
+}
@@ -0,0 +1,176 @@
+#include <math.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "sampling.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SAMPLE_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SAMPLE_AVX2 1
+#endif
+
+using namespace cv;
+
+// Every version uses the same trick: a point is inside when 1 <= x < cols-1 and 1 <= y < rows-1,
+// which is false for NaN, and points outside are moved to (1,1) before the lookups.
+// After that x and y are positive, so truncating them is the same as floor.
+
+void sample_flow_scalar(const Mat& flow, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid){
+	float xhi = flow.cols - 1;
+	float yhi = flow.rows - 1;
+	for ( int i = 0; i < n; i++ ) {
+		float x = xs[i];
+		float y = ys[i];
+		if ( !(x >= 1 && x < xhi && y >= 1 && y < yhi) ) {
+			dx[i] = 0; dy[i] = 0; valid[i] = 0;
+			continue;
+		}
+
+		int xind = (int)x;
+		int yind = (int)y;
+		float xrem = x - xind;
+		float yrem = y - yind;
+
+		//Bilinear interpolation
+		const float* p0 = flow.ptr<float>(yind) + xind * 2;
+		const float* p1 = flow.ptr<float>(yind + 1) + xind * 2;
+		float w00 = (1-xrem)*(1-yrem), w01 = xrem*(1-yrem), w10 = (1-xrem)*yrem, w11 = xrem*yrem;
+		dx[i] = p0[0]*w00 + p0[2]*w01 + p1[0]*w10 + p1[2]*w11;
+		dy[i] = p0[1]*w00 + p0[3]*w01 + p1[1]*w10 + p1[3]*w11;
+		valid[i] = 1;
+	}
+}
+
+#ifdef SAMPLE_SSE2
+// base, stride - first float of the flow and floats per row
+// returns how many points were done, a multiple of 4
+static int sample_flow_sse2(const float* base, int stride, int cols, int rows, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid){
+	const __m128 lo = _mm_set1_ps(1.0f);
+	const __m128 xhi = _mm_set1_ps(cols - 1);
+	const __m128 yhi = _mm_set1_ps(rows - 1);
+	int i = 0;
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128 x = _mm_loadu_ps(xs + i);
+		__m128 y = _mm_loadu_ps(ys + i);
+		__m128 in = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(x, lo), _mm_cmplt_ps(x, xhi)),
+		                       _mm_and_ps(_mm_cmpge_ps(y, lo), _mm_cmplt_ps(y, yhi)));
+		x = _mm_or_ps(_mm_and_ps(in, x), _mm_andnot_ps(in, lo));
+		y = _mm_or_ps(_mm_and_ps(in, y), _mm_andnot_ps(in, lo));
+
+		__m128i xi = _mm_cvttps_epi32(x);
+		__m128i yi = _mm_cvttps_epi32(y);
+		__m128 xr = _mm_sub_ps(x, _mm_cvtepi32_ps(xi));
+		__m128 yr = _mm_sub_ps(y, _mm_cvtepi32_ps(yi));
+
+		// no gather in SSE2, the four corners are loaded lane by lane
+		int xa[4], ya[4];
+		_mm_storeu_si128((__m128i*)xa, xi);
+		_mm_storeu_si128((__m128i*)ya, yi);
+		float c[8][4];
+		for ( int k = 0; k < 4; k++ ) {
+			const float* p0 = base + ya[k] * stride + xa[k] * 2;
+			const float* p1 = p0 + stride;
+			c[0][k] = p0[0]; c[1][k] = p0[1]; c[2][k] = p0[2]; c[3][k] = p0[3];
+			c[4][k] = p1[0]; c[5][k] = p1[1]; c[6][k] = p1[2]; c[7][k] = p1[3];
+		}
+
+		__m128 xr1 = _mm_sub_ps(lo, xr);
+		__m128 yr1 = _mm_sub_ps(lo, yr);
+		__m128 w00 = _mm_mul_ps(xr1, yr1);
+		__m128 w01 = _mm_mul_ps(xr, yr1);
+		__m128 w10 = _mm_mul_ps(xr1, yr);
+		__m128 w11 = _mm_mul_ps(xr, yr);
+
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[0]), w00), _mm_mul_ps(_mm_loadu_ps(c[2]), w01)),
+		                       _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[4]), w10), _mm_mul_ps(_mm_loadu_ps(c[6]), w11)));
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[1]), w00), _mm_mul_ps(_mm_loadu_ps(c[3]), w01)),
+		                       _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(c[5]), w10), _mm_mul_ps(_mm_loadu_ps(c[7]), w11)));
+		_mm_storeu_ps(dx + i, _mm_and_ps(rx, in));
+		_mm_storeu_ps(dy + i, _mm_and_ps(ry, in));
+
+		int mask = _mm_movemask_ps(in);
+		for ( int k = 0; k < 4; k++ ) valid[i + k] = (mask >> k) & 1;
+	}
+	return i;
+}
+#endif
+
+#ifdef SAMPLE_AVX2
+// As sample_flow_sse2, 8 points at a time with the corners gathered.
+__attribute__((target("avx2")))
+static int sample_flow_avx2(const float* base, int stride, int cols, int rows, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid){
+	const __m256 lo = _mm256_set1_ps(1.0f);
+	const __m256 xhi = _mm256_set1_ps(cols - 1);
+	const __m256 yhi = _mm256_set1_ps(rows - 1);
+	const __m256i vstride = _mm256_set1_epi32(stride);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i two = _mm256_set1_epi32(2);
+	const __m256i three = _mm256_set1_epi32(3);
+	int i = 0;
+	for ( ; i + 8 <= n; i += 8 ) {
+		__m256 x = _mm256_loadu_ps(xs + i);
+		__m256 y = _mm256_loadu_ps(ys + i);
+		__m256 in = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(x, lo, _CMP_GE_OQ), _mm256_cmp_ps(x, xhi, _CMP_LT_OQ)),
+		                          _mm256_and_ps(_mm256_cmp_ps(y, lo, _CMP_GE_OQ), _mm256_cmp_ps(y, yhi, _CMP_LT_OQ)));
+		x = _mm256_blendv_ps(lo, x, in);
+		y = _mm256_blendv_ps(lo, y, in);
+
+		__m256i xi = _mm256_cvttps_epi32(x);
+		__m256i yi = _mm256_cvttps_epi32(y);
+		__m256 xr = _mm256_sub_ps(x, _mm256_cvtepi32_ps(xi));
+		__m256 yr = _mm256_sub_ps(y, _mm256_cvtepi32_ps(yi));
+
+		// float index of the top left corner, the others are +2, +stride and +stride+2
+		__m256i i00 = _mm256_add_epi32(_mm256_mullo_epi32(yi, vstride), _mm256_slli_epi32(xi, 1));
+		__m256i i10 = _mm256_add_epi32(i00, vstride);
+
+		__m256 xr1 = _mm256_sub_ps(lo, xr);
+		__m256 yr1 = _mm256_sub_ps(lo, yr);
+		__m256 w00 = _mm256_mul_ps(xr1, yr1);
+		__m256 w01 = _mm256_mul_ps(xr, yr1);
+		__m256 w10 = _mm256_mul_ps(xr1, yr);
+		__m256 w11 = _mm256_mul_ps(xr, yr);
+
+		__m256 rx = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(base, i00, 4), w00),
+			              _mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i00, two), 4), w01)),
+			_mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(base, i10, 4), w10),
+			              _mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i10, two), 4), w11)));
+		__m256 ry = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i00, one), 4), w00),
+			              _mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i00, three), 4), w01)),
+			_mm256_add_ps(_mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i10, one), 4), w10),
+			              _mm256_mul_ps(_mm256_i32gather_ps(base, _mm256_add_epi32(i10, three), 4), w11)));
+		_mm256_storeu_ps(dx + i, _mm256_and_ps(rx, in));
+		_mm256_storeu_ps(dy + i, _mm256_and_ps(ry, in));
+
+		int mask = _mm256_movemask_ps(in);
+		for ( int k = 0; k < 8; k++ ) valid[i + k] = (mask >> k) & 1;
+	}
+	return i;
+}
+#endif
+
+void sample_flow(const Mat& flow, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid){
+	int done = 0;
+
+	// the vector versions need a pixel on every side of a valid point
+	if ( flow.cols >= 3 && flow.rows >= 3 ) {
+		const float* base = flow.ptr<float>(0);
+		int stride = (int)(flow.step / sizeof(float));
+#ifdef SAMPLE_AVX2
+		static const bool avx2 = checkHardwareSupport(CV_CPU_AVX2);
+		if ( avx2 ) done = sample_flow_avx2(base, stride, flow.cols, flow.rows, xs, ys, n, dx, dy, valid);
+#endif
+#ifdef SAMPLE_SSE2
+		if ( done == 0 ) done = sample_flow_sse2(base, stride, flow.cols, flow.rows, xs, ys, n, dx, dy, valid);
+#endif
+	}
+
+	if ( done < n ) sample_flow_scalar(flow, xs + done, ys + done, n - done, dx + done, dy + done, valid + done);
+}
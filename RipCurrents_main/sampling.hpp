@@ -0,0 +1,19 @@
+#ifndef __SAMPLING_HPP_INCLUDE__
+#define __SAMPLING_HPP_INCLUDE__
+
+#include <opencv2/opencv.hpp>
+
+#define SAMPLE_BLOCK 256 // Points per sample_flow() call in the advection loops, sized for the stack
+
+// Bilinear interpolation of a CV_32FC2 flow at n points.
+// xs, ys - sample positions in pixels
+// dx, dy - output: interpolated flow, 0 where not valid
+// valid - output: 1 where the point is inside the flow, with the bounds the advection always used
+//         (1 <= floor(x) <= cols-2, same for y), 0 elsewhere
+// Uses AVX2 when the cpu has it, SSE2 on other x86, plain C elsewhere.
+void sample_flow(const cv::Mat& flow, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid);
+
+// The plain C version, also the reference for the vector ones.
+void sample_flow_scalar(const cv::Mat& flow, const float* xs, const float* ys, int n, float* dx, float* dy, unsigned char* valid);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "timing.hpp"
+
+StageTimes stage_times;
+
+static const char* stage_names[STAGE_COUNT] = {
+	"decode", "resize", "flow", "advection", "averageVector", "averageHSV", "histogram", "render", "encode"
+};
+
+// Values below 2*LATENCY_SUBBUCKETS microseconds get a bucket each,
+// above that every power of two is split into LATENCY_SUBBUCKETS buckets.
+static int bucket_index(uint64_t micros){
+	if ( micros < 2 * LATENCY_SUBBUCKETS ) return (int)micros;
+	int msb = 63;
+	while ( !(micros >> msb) ) msb--;
+	int shift = msb - 5;
+	int top = (int)(micros >> shift);
+	int index = (shift + 1) * LATENCY_SUBBUCKETS + top - LATENCY_SUBBUCKETS;
+	return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// returns the middle of a bucket in microseconds
+static double bucket_value(int index){
+	if ( index < 2 * LATENCY_SUBBUCKETS ) return index + 0.5;
+	int shift = index / LATENCY_SUBBUCKETS - 1;
+	double top = index % LATENCY_SUBBUCKETS + LATENCY_SUBBUCKETS;
+	return (top + 0.5) * (double)(1ULL << shift);
+}
+
+LatencyHistogram::LatencyHistogram(){
+	clear();
+}
+
+void LatencyHistogram::clear(){
+	for ( int i = 0; i < LATENCY_BUCKETS; i++ ) buckets[i] = 0;
+	samples = 0;
+	total = 0;
+	maximum = 0;
+}
+
+void LatencyHistogram::record(double seconds){
+	if ( seconds < 0 ) seconds = 0;
+	buckets[bucket_index((uint64_t)(seconds * 1000000.0))]++;
+	samples++;
+	total += seconds;
+	if ( seconds > maximum ) maximum = seconds;
+}
+
+double LatencyHistogram::mean() const {
+	return samples ? total / samples : 0;
+}
+
+double LatencyHistogram::percentile(double p) const {
+	if ( samples == 0 ) return 0;
+	long target = (long)(p * samples);
+	if ( target >= samples ) target = samples - 1;
+	long seen = 0;
+	for ( int i = 0; i < LATENCY_BUCKETS; i++ ) {
+		seen += buckets[i];
+		if ( seen > target ) {
+			double value = bucket_value(i) / 1000000.0;
+			return value < maximum ? value : maximum;
+		}
+	}
+	return maximum;
+}
+
+StageTimes::StageTimes() : frames(0), report_every(0) {}
+
+void StageTimes::record(int stage, double seconds){
+	std::lock_guard<std::mutex> lock(mutex);
+	run[stage].record(seconds);
+	interval[stage].record(seconds);
+}
+
+void StageTimes::end_frame(){
+	std::lock_guard<std::mutex> lock(mutex);
+	frames++;
+	if ( report_every > 0 && frames % report_every == 0 ) {
+		char title[64];
+		snprintf(title, sizeof(title), "frames %ld-%ld", frames - report_every + 1, frames);
+		print(title, interval, report_every);
+		for ( int stage = 0; stage < STAGE_COUNT; stage++ ) interval[stage].clear();
+	}
+}
+
+void StageTimes::report(){
+	std::lock_guard<std::mutex> lock(mutex);
+	print("whole run", run, frames);
+}
+
+// title - heading of the table
+// stages - one histogram per stage
+// frames - number of frames the histograms cover
+void StageTimes::print(const char* title, LatencyHistogram* stages, long frames){
+	printf("Stage latency, %s (%ld frames), in ms\n", title, frames);
+	printf("%-14s %8s %9s %9s %9s %9s %9s\n", "stage", "count", "mean", "p50", "p95", "p99", "max");
+	for ( int stage = 0; stage < STAGE_COUNT; stage++ ) {
+		if ( stages[stage].count() == 0 ) continue;
+		printf("%-14s %8ld %9.3f %9.3f %9.3f %9.3f %9.3f\n", stage_names[stage], stages[stage].count(),
+			stages[stage].mean() * 1000, stages[stage].percentile(.50) * 1000, stages[stage].percentile(.95) * 1000,
+			stages[stage].percentile(.99) * 1000, stages[stage].max() * 1000);
+	}
+	fflush(stdout);
+}
@@ -0,0 +1,79 @@
+#ifndef __TIMING_HPP_INCLUDE__
+#define __TIMING_HPP_INCLUDE__
+
+#include <chrono>
+#include <mutex>
+
+// Stages of a frame that get timed
+enum Stage {
+	STAGE_DECODE,
+	STAGE_RESIZE,
+	STAGE_FLOW,
+	STAGE_ADVECTION,
+	STAGE_AVERAGE_VECTOR,
+	STAGE_AVERAGE_HSV,
+	STAGE_HISTOGRAM,
+	STAGE_RENDER,
+	STAGE_ENCODE,
+	STAGE_COUNT
+};
+
+#define LATENCY_SUBBUCKETS 32 // Buckets per power of two, about 3% resolution
+#define LATENCY_BUCKETS (60 * LATENCY_SUBBUCKETS)
+
+// Latency distribution with microsecond buckets that grow with the value,
+// so memory and the cost of a percentile stay fixed however long it runs.
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+	void record(double seconds);
+	void clear();
+	long count() const { return samples; }
+	double mean() const;
+	double max() const { return maximum; }
+	double percentile(double p) const;	// in seconds, p in [0,1]
+
+private:
+	long buckets[LATENCY_BUCKETS];
+	long samples;
+	double total;
+	double maximum;
+};
+
+// Per-stage latencies of the whole run, and of the frames since the last periodic report.
+// record() may be called from any pipeline thread.
+class StageTimes {
+public:
+	StageTimes();
+	void record(int stage, double seconds);
+	void set_report_every(int frames) { report_every = frames; }
+	void end_frame();	// prints the periodic report every report_every frames
+	void report();	// prints the whole run
+
+private:
+	void print(const char* title, LatencyHistogram* stages, long frames);
+
+	std::mutex mutex;
+	LatencyHistogram run[STAGE_COUNT];
+	LatencyHistogram interval[STAGE_COUNT];
+	long frames;
+	int report_every;
+};
+
+extern StageTimes stage_times;
+
+// Times its own scope with the monotonic clock and records it for a stage.
+class ScopedTimer {
+public:
+	explicit ScopedTimer(int stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+	~ScopedTimer(){
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		stage_times.record(stage, elapsed.count());
+	}
+
+private:
+	int stage;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif
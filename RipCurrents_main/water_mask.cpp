@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "water_mask.hpp"
+
+// name - a bitmap, any image with the aspect of the input, nonzero on water;
+//        or a text file of polygons, one "x y" or "x,y" vertex per line in pixels of the input video,
+//        a blank line starts the next polygon and # starts a comment
+// input_size - resolution of the input video, the polygons are scaled from it
+// size - analysis resolution
+// water - output: the mask
+// returns false if the file can not be read or has no polygon in it
+bool load_mask(const String& name, Size input_size, Size size, Mat& water){
+	Mat image = imread(name, IMREAD_GRAYSCALE);
+	if ( !image.empty() ) {
+		resize(image, water, size, 0, 0, INTER_NEAREST);
+		threshold(water, water, 0, 255, THRESH_BINARY);
+		return true;
+	}
+
+	FILE* file = fopen(name.c_str(), "r");
+	if ( !file ) return false;
+	double sx = (double)size.width / input_size.width;
+	double sy = (double)size.height / input_size.height;
+	std::vector<std::vector<Point> > polygons(1);
+	char line[256];
+	bool ok = true;
+	while ( ok && fgets(line, sizeof(line), file) ) {
+		char* comment = strchr(line, '#');
+		if ( comment ) *comment = 0;
+		double x, y;
+		char c;
+		if ( sscanf(line, "%lf%*[ ,\t]%lf", &x, &y) == 2 ) polygons.back().push_back(Point(cvRound(x * sx), cvRound(y * sy)));
+		else if ( sscanf(line, " %c", &c) == 1 ) ok = false;
+		else if ( !polygons.back().empty() ) polygons.push_back(std::vector<Point>());
+	}
+	fclose(file);
+
+	// a line or a point covers no water
+	for ( size_t i = polygons.size(); i-- > 0; )
+		if ( polygons[i].size() < 3 ) polygons.erase(polygons.begin() + i);
+	if ( !ok || polygons.empty() ) return false;
+
+	water = Mat::zeros(size, CV_8UC1);
+	fillPoly(water, polygons, Scalar(255));
+	return true;
+}
+
+// Averages the first frames of the video the way averageHSVEMA() does, measures how much
+// every pixel changes between them, and has color_mask() find the water in that.
+// The video is rewound afterwards; a camera can not be, those frames are just not analyzed.
+// frames - how many to average
+// water - output: the mask, empty if too little looked like water
+// returns false if the video ended first
+bool learn_mask(VideoCapture& video, Size size, int frames, Mat& water){
+	Mat frame, subframe, gray, prev_gray, diff;
+	Mat accumulator = Mat::zeros(size, CV_32FC3);
+	Mat average = Mat::zeros(size, CV_8UC3);
+	Mat motion = Mat::zeros(size, CV_32FC1);
+
+	int read = 0;
+	for ( ; read < frames && video.read(frame) && !frame.empty(); read++ ) {
+		resize(frame, subframe, size, 0, 0, INTER_LINEAR);
+		// a weight of 1/n makes it the exact mean of the frames so far
+		averageHSVEMA(subframe, accumulator, average, 1.0f / (read + 1));
+
+		cvtColor(subframe, gray, COLOR_BGR2GRAY);
+		if ( read > 0 ) {
+			absdiff(gray, prev_gray, diff);
+			accumulateWeighted(diff, motion, 1.0 / read);
+		}
+		std::swap(gray, prev_gray);
+	}
+	video.set(CAP_PROP_POS_FRAMES, 0);
+	if ( read < 2 ) return false;
+
+	color_mask(average, motion, water);
+	return true;
+}
+
+// average - CV_8UC3 bgr average of some frames
+// motion - CV_32FC1 mean absolute gray level change per frame
+// water - output: water colored or moving, smoothed; empty if that is under MASK_MIN_AREA of the frame
+void color_mask(const Mat& average, const Mat& motion, Mat& water){
+	Mat hsv, colored;
+	cvtColor(average, hsv, COLOR_BGR2HSV);
+	inRange(hsv, Scalar(MASK_HUE_LO, MASK_SAT_MIN, 0), Scalar(MASK_HUE_HI, 255, MASK_VALUE_MAX), colored);
+	Mat moving = motion > MASK_MOTION_MIN;
+	bitwise_or(colored, moving, water);
+
+	// close the gaps between waves, then drop the specks, at a scale that follows the resolution
+	int k = std::max(3, water.cols / 80) | 1;
+	Mat window = getStructuringElement(MORPH_ELLIPSE, Size(k, k));
+	morphologyEx(water, water, MORPH_CLOSE, window);
+	morphologyEx(water, water, MORPH_OPEN, window);
+
+	if ( countNonZero(water) < MASK_MIN_AREA * water.total() ) water.release();
+}
+
+// water - mask, or empty
+// size - analysis resolution
+// returns the bounding rectangle of the water with MASK_PAD pixels around it, the whole frame without water
+Rect mask_bounds(const Mat& water, Size size){
+	Rect bounds = water.empty() ? Rect() : boundingRect(water);
+	if ( bounds.width == 0 || bounds.height == 0 ) return Rect(0, 0, size.width, size.height);
+
+	int x0 = std::max(bounds.x - MASK_PAD, 0);
+	int y0 = std::max(bounds.y - MASK_PAD, 0);
+	int x1 = std::min(bounds.x + bounds.width + MASK_PAD, size.width);
+	int y1 = std::min(bounds.y + bounds.height + MASK_PAD, size.height);
+	return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// water - mask, or empty
+// water_grid - output: CV_8UC1 GRID_COUNT x GRID_COUNT, the water at the centers of the arrow cells
+//              compute_sparse_flow() tracks; empty without a mask
+void grid_mask(const Mat& water, Mat& water_grid){
+	if ( water.empty() ) {
+		water_grid.release();
+		return;
+	}
+	water_grid.create(GRID_COUNT, GRID_COUNT, CV_8UC1);
+	for ( int row = 0; row < GRID_COUNT; row++ ) {
+		uchar* ptr = water_grid.ptr<uchar>(row);
+		for ( int col = 0; col < GRID_COUNT; col++ ) {
+			ptr[col] = water.at<uchar>((int)((row + .5f) * water.rows / GRID_COUNT), (int)((col + .5f) * water.cols / GRID_COUNT));
+		}
+	}
+}
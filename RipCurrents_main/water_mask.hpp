@@ -0,0 +1,29 @@
+#ifndef __WATER_MASK_HPP_INCLUDE__
+#define __WATER_MASK_HPP_INCLUDE__
+
+#include <opencv2/opencv.hpp>
+
+#include "ripcurrents.hpp"
+
+// Where the water is. A water mask is CV_8UC1 at the analysis resolution, nonzero on water,
+// and an empty Mat means the whole frame. Sky, sand and piers outside it are not analyzed.
+
+#define MASK_PAD 8 // pixels of context the flow gets around the water
+#define MASK_AUTO_FRAMES 60 // frames averaged before --mask auto decides where the water is
+#define MASK_MIN_AREA 0.05 // an automatic mask smaller than this part of the frame is not trusted
+
+// What --mask auto calls water, in the average color (OpenCV HSV, hue 0-180)
+#define MASK_HUE_LO 75 // green
+#define MASK_HUE_HI 130 // blue
+#define MASK_SAT_MIN 40 // gray sand, concrete and haze are not water
+#define MASK_VALUE_MAX 200 // nor is bright sky
+#define MASK_MOTION_MIN 4.0 // mean gray level change per frame of surf and foam, whatever their color
+
+bool load_mask(const String& name, Size input_size, Size size, Mat& water);
+bool learn_mask(VideoCapture& video, Size size, int frames, Mat& water);
+void color_mask(const Mat& average, const Mat& motion, Mat& water);
+
+Rect mask_bounds(const Mat& water, Size size);
+void grid_mask(const Mat& water, Mat& water_grid);
+
+#endif